@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "audio.h"
+
+AudioRing::AudioRing(size_t capacity) {
+	size_t size = 1;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	samples.resize(size);
+	mask = size - 1;
+}
+
+size_t AudioRing::push(const int16_t* data, size_t count) {
+	size_t write = write_position.load(std::memory_order_relaxed);
+	size_t read = read_position.load(std::memory_order_acquire);
+	size_t pushed = std::min(count, samples.size() - (write - read));
+	for (size_t i = 0; i < pushed; i++) {
+		samples[(write + i) & mask] = data[i];
+	}
+	// The consumer only sees the new position after the samples are in place
+	write_position.store(write + pushed, std::memory_order_release);
+	if (pushed < count) {
+		dropped_samples.fetch_add(count - pushed, std::memory_order_relaxed);
+	}
+	return pushed;
+}
+
+size_t AudioRing::pop(int16_t* out, size_t count) {
+	size_t read = read_position.load(std::memory_order_relaxed);
+	size_t write = write_position.load(std::memory_order_acquire);
+	size_t popped = std::min(count, write - read);
+	for (size_t i = 0; i < popped; i++) {
+		out[i] = samples[(read + i) & mask];
+	}
+	// The producer only reuses the slots after they were copied out
+	read_position.store(read + popped, std::memory_order_release);
+	return popped;
+}
+
+size_t AudioRing::get_available() const {
+	return write_position.load(std::memory_order_acquire) - read_position.load(std::memory_order_acquire);
+}
+
+long long AudioRing::get_dropped_samples() const {
+	return dropped_samples.load(std::memory_order_relaxed);
+}
+
+Beeper::Beeper(AudioRing& ring, int sample_rate, int instructions_per_second)
+	: ring(ring), sample_rate(sample_rate), instructions_per_second(instructions_per_second),
+	samples_per_frame(sample_rate / 60) {
+	frame_samples.resize(samples_per_frame);
+	// Averaging never makes a frame longer, so pushing to output never allocates
+	output.reserve(samples_per_frame);
+}
+
+void Beeper::set_speed(int speed) {
+	this->speed = std::max(speed, 0);
+	sum = 0;
+	sum_count = 0;
+}
+
+int Beeper::get_speed() const {
+	return speed;
+}
+
+void Beeper::update(const Chip8& emu) {
+	bool was_playing = playing;
+	playing = emu.get_sound_timer() > 0;
+	use_pattern = emu.get_variant() == VARIANT_XOCHIP;
+	if (use_pattern) {
+		std::memcpy(pattern, emu.get_audio_pattern(), sizeof(pattern));
+		phase_step = AUDIO_PATTERN_BASE_RATE * std::pow(2.0, (emu.get_pitch() - 64) / 48.0) / sample_rate;
+	} else {
+		phase_step = (double)BEEPER_FREQUENCY_HZ / sample_rate;
+	}
+	// Every beep starts at the beginning of the wave, a change while playing continues where it was
+	if (!was_playing) {
+		phase = 0;
+	}
+}
+
+void Beeper::generate(int position) {
+	position = std::min(position, samples_per_frame);
+	for (; frame_position < position; frame_position++) {
+		int16_t sample = 0;
+		if (playing) {
+			bool high;
+			if (use_pattern) {
+				int bit = (int)phase;
+				high = (pattern[bit >> 3] >> (7 - (bit & 7))) & 1;
+			} else {
+				high = phase - std::floor(phase) < 0.5;
+			}
+			sample = high ? BEEPER_AMPLITUDE : -BEEPER_AMPLITUDE;
+			// 128 is a whole number of buzzer periods as well as the length of the pattern
+			phase += phase_step;
+			if (phase >= 128) {
+				phase -= 128;
+			}
+		}
+		frame_samples[frame_position] = sample;
+	}
+}
+
+void Beeper::begin_frame(const Chip8& emu) {
+	frame_start_cycle = emu.get_cycle_count();
+	frame_position = 0;
+	update(emu);
+}
+
+void Beeper::sound_changed(const Chip8& emu) {
+	long long cycles = emu.get_cycle_count() - frame_start_cycle;
+	generate((int)std::min(cycles * sample_rate / instructions_per_second, (long long)samples_per_frame));
+	update(emu);
+}
+
+void Beeper::end_frame(const Chip8& emu) {
+	generate(samples_per_frame);
+	if (speed == 0) {
+		return;
+	}
+
+	for (int i = 0; i < samples_per_frame; i++) {
+		sum += frame_samples[i];
+		if (++sum_count == speed) {
+			output.push_back(sum / speed);
+			sum = 0;
+			sum_count = 0;
+		}
+	}
+	// Whatever doesn't fit is dropped, the emulation never waits for the sink
+	ring.push(output.data(), output.size());
+	output.clear();
+}
+
+static void write_u16(std::ofstream& file, uint16_t value) {
+	byte bytes[2] = { (byte)(value & 0xFF), (byte)(value >> 8) };
+	file.write((const char*)bytes, 2);
+}
+
+static void write_u32(std::ofstream& file, uint32_t value) {
+	write_u16(file, value & 0xFFFF);
+	write_u16(file, value >> 16);
+}
+
+WavWriter::WavWriter(const char* filename, int sample_rate) : sample_rate(sample_rate) {
+	file.open(filename, std::ios::out | std::ios::binary);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to create WAV file");
+	}
+
+	file.write("RIFF", 4);
+	write_u32(file, 36); // Filled in by finish
+	file.write("WAVEfmt ", 8);
+	write_u32(file, 16);
+	write_u16(file, 1); // PCM
+	write_u16(file, 1); // Mono
+	write_u32(file, sample_rate);
+	write_u32(file, sample_rate * 2);
+	write_u16(file, 2);
+	write_u16(file, 16);
+	file.write("data", 4);
+	write_u32(file, 0); // Filled in by finish
+}
+
+WavWriter::~WavWriter() {
+	try {
+		finish();
+	}
+	catch (const std::runtime_error&) {
+		// Destructors can't report it, callers that care call finish themselves
+	}
+}
+
+void WavWriter::drain(AudioRing& ring) {
+	int16_t samples[1024];
+	size_t count;
+	while ((count = ring.pop(samples, 1024)) > 0) {
+		for (size_t i = 0; i < count; i++) {
+			write_u16(file, (uint16_t)samples[i]);
+		}
+		sample_count += count;
+	}
+}
+
+void WavWriter::finish() {
+	if (finished) {
+		return;
+	}
+	finished = true;
+
+	file.seekp(4);
+	write_u32(file, 36 + sample_count * 2);
+	file.seekp(40);
+	write_u32(file, sample_count * 2);
+	file.close();
+	if (file.fail()) {
+		throw std::runtime_error("Failed to write WAV file");
+	}
+}
+
+uint32_t WavWriter::get_sample_count() const {
+	return sample_count;
+}
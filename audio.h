@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include "chip8.h"
+
+#define AUDIO_SAMPLE_RATE 48000
+// About a third of a second at 48kHz, a few frames of slack between the emulation and the sink
+#define AUDIO_RING_SIZE 16384
+// Frequency of the buzzer of CHIP-8 and SUPER-CHIP, which only have an on/off sound
+#define BEEPER_FREQUENCY_HZ 440
+#define BEEPER_AMPLITUDE 6000
+// XO-CHIP plays its audio pattern at 4000 bits per second at pitch 64
+#define AUDIO_PATTERN_BASE_RATE 4000.0
+
+/*
+Lock-free ring of 16-bit mono samples between one producer thread (the emulation) and one consumer
+thread (the audio sink). Each side only writes its own position and reads the other's, so neither
+ever takes a lock or waits: push drops the samples that don't fit and pop returns what is there.
+*/
+class AudioRing {
+	std::vector<int16_t> samples;
+	size_t mask;
+	// On separate cache lines, so the two threads don't keep stealing each other's line
+	alignas(64) std::atomic<size_t> write_position{0};
+	alignas(64) std::atomic<size_t> read_position{0};
+	std::atomic<long long> dropped_samples{0};
+public:
+	// The capacity is rounded up to a power of two
+	explicit AudioRing(size_t capacity = AUDIO_RING_SIZE);
+	AudioRing(const AudioRing&) = delete;
+	AudioRing& operator=(const AudioRing&) = delete;
+
+	// Producer side. Returns how many samples were queued, the rest are dropped.
+	size_t push(const int16_t* data, size_t count);
+	// Consumer side. Returns how many samples were copied to out.
+	size_t pop(int16_t* out, size_t count);
+	// Samples queued and not popped yet, exact only on the consumer side
+	size_t get_available() const;
+	// Samples pushed while the ring was full
+	long long get_dropped_samples() const;
+};
+
+/*
+Turns the sound timer of an interpreter into samples. CHIP-8 and SUPER-CHIP get a square wave
+buzzer, XO-CHIP plays its audio pattern at its pitch.
+
+Samples are in emulated time: every emulated frame is exactly sample_rate / 60 samples, and a
+change in the middle of a frame (passed on by the host's sound_changed) lands on the sample of the
+cycle it happened at, counted from the start of the frame at the instruction rate. The samples of
+a frame are pushed to the ring when it ends. Fast-forwarding N frames per real frame averages every
+N samples together, which keeps the ring at the real time rate, and a speed of 0 mutes the output
+(uncapped runs), so the sink never gets more than it can play.
+*/
+class Beeper {
+	AudioRing& ring;
+	int sample_rate;
+	int instructions_per_second;
+	int samples_per_frame;
+	int speed = 1;
+
+	// What is playing now
+	bool playing = false;
+	bool use_pattern = false;
+	byte pattern[16] = {};
+	// Pattern bits (or buzzer periods) per sample, and the position in the pattern (or period)
+	double phase_step = 0;
+	double phase = 0;
+
+	long long frame_start_cycle = 0;
+	// Samples of the current frame generated so far
+	int frame_position = 0;
+	std::vector<int16_t> frame_samples;
+	// Samples of the frame after averaging, and the average that isn't complete yet
+	std::vector<int16_t> output;
+	int sum = 0;
+	int sum_count = 0;
+
+	// Generate the samples of the current frame up to (not including) position
+	void generate(int position);
+	// Take the sound settings from the interpreter
+	void update(const Chip8& emu);
+public:
+	Beeper(AudioRing& ring, int sample_rate, int instructions_per_second);
+
+	// 1 for real time, N when N emulated frames run per real frame, 0 to mute
+	void set_speed(int speed);
+	int get_speed() const;
+
+	// Call before running an emulated frame
+	void begin_frame(const Chip8& emu);
+	// Call from the host's sound_changed
+	void sound_changed(const Chip8& emu);
+	// Call after running an emulated frame, before ticking the timers
+	void end_frame(const Chip8& emu);
+};
+
+/*
+Headless audio sink: drains a ring into a 16-bit mono WAV file. The header is written with zero
+sizes first and filled in by finish, which the destructor calls.
+*/
+class WavWriter {
+	std::ofstream file;
+	int sample_rate;
+	uint32_t sample_count = 0;
+	bool finished = false;
+public:
+	// Throws std::runtime_error if the file can't be created
+	WavWriter(const char* filename, int sample_rate);
+	~WavWriter();
+	WavWriter(const WavWriter&) = delete;
+	WavWriter& operator=(const WavWriter&) = delete;
+
+	// Append everything queued in the ring
+	void drain(AudioRing& ring);
+	// Write the sizes into the header and close the file
+	void finish();
+	uint32_t get_sample_count() const;
+};
@@ -0,0 +1,520 @@
+/*
+Interpreter benchmarks. Build from the repository root with, for example:
+	g++ -std=c++17 -O2 -I. -o chip8_bench bench/bench.cpp audio.cpp chip8.cpp chip8_batch.cpp chip8_fork.cpp chip8_jit.cpp movie.cpp rewind.cpp scaler.cpp scheduler.cpp
+and add -DCHIP8_DISPATCH=CHIP8_DISPATCH_SWITCH (or _TABLE, _GOTO) to compare dispatch strategies, which
+bench/compare_dispatch.sh does for all three.
+
+	chip8_bench [--workloads] [--trace ROM_FILE MOVIE_FILE]...
+--workloads only runs the synthetic workloads (and traces), which are what dispatch changes affect.
+--trace replays a movie recorded with --record, to measure a real game with real input.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "audio.h"
+#include "chip8.h"
+#include "chip8_batch.h"
+#include "chip8_fork.h"
+#include "chip8_jit.h"
+#include "movie.h"
+#include "rewind.h"
+#include "scaler.h"
+
+// Every allocation is counted, the interpreter shouldn't allocate at all while it runs. The other
+// forms forward to these two, which are never inlined, so the compiler never sees malloc on one
+// side and operator delete on the other (-Wmismatched-new-delete).
+static std::atomic<long long> allocation_count(0);
+
+[[gnu::noinline]] void* operator new(size_t size) {
+	allocation_count++;
+	if (void* ptr = std::malloc(size ? size : 1)) {
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t /*size*/) noexcept {
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr, size_t /*size*/) noexcept {
+	operator delete(ptr);
+}
+
+// Host that never presses keys and never waits
+class BenchHost : public Chip8Host {
+public:
+	bool is_key_down(int key_number) override { return false; }
+	void enable_key_capture() override {}
+	int get_capture_key() override { return -1; }
+
+	bool process_events() override { return true; }
+	void present(const Chip8& emu) override {}
+	void wait_until(std::chrono::steady_clock::time_point deadline) override {}
+};
+
+static const char* dispatch_name() {
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_SWITCH
+	return "switch";
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_TABLE
+	return "table";
+#else
+	return "goto";
+#endif
+}
+
+static std::vector<byte> make_rom(const std::vector<unsigned short>& program) {
+	std::vector<byte> rom;
+	for (unsigned short instr : program) {
+		rom.push_back((instr >> 8) & 0xFF);
+		rom.push_back(instr & 0xFF);
+	}
+	return rom;
+}
+
+// Endless loop of arithmetic instructions
+static std::vector<byte> alu_rom() {
+	return make_rom({
+		0x6001, // LD V0, 1
+		0x6103, // LD V1, 3
+		0x8014, // ADD V0, V1
+		0x8125, // SUB V1, V2
+		0x8206, // SHR V2
+		0x830E, // SHL V3
+		0x8401, // OR V4, V0
+		0x8512, // AND V5, V1
+		0x8623, // XOR V6, V2
+		0x7701, // ADD V7, 1
+		0x3700, // SE V7, 0
+		0x1204, // JP 0x204
+		0x1200, // JP 0x200
+	});
+}
+
+// Draws a random digit at a moving position, on top of the previous ones, every few instructions
+static std::vector<byte> sprite_rom() {
+	return make_rom({
+		0x6000, // LD V0, 0
+		0x6100, // LD V1, 0
+		0xC20F, // RND V2, 0x0F
+		0xF229, // LD F, V2
+		0xD015, // DRW V0, V1, 5
+		0x7003, // ADD V0, 3
+		0x7102, // ADD V1, 2
+		0x1204, // JP 0x204
+	});
+}
+
+// Clears the screen and draws the same sprites at the same places again, like most games every frame
+static std::vector<byte> redraw_rom() {
+	return make_rom({
+		0x00E0, // CLS
+		0x6008, // LD V0, 8
+		0x6104, // LD V1, 4
+		0xA000, // LD I, 0x000
+		0xD01F, // DRW V0, V1, 15
+		0x7011, // ADD V0, 17
+		0xA050, // LD I, 0x050
+		0xD01F, // DRW V0, V1, 15
+		0x7011, // ADD V0, 17
+		0xA0A0, // LD I, 0x0A0
+		0xD01F, // DRW V0, V1, 15
+		0x1200, // JP 0x200
+	});
+}
+
+// Nested subroutine calls, two thirds of the instructions are CALL or RET
+static std::vector<byte> call_rom() {
+	return make_rom({
+		0x2204, // CALL 0x204
+		0x1200, // JP 0x200
+		0x2208, // CALL 0x208
+		0x00EE, // RET
+		0x7001, // ADD V0, 1
+		0x00EE, // RET
+	});
+}
+
+// Stores and loads registers and BCD digits to a buffer past the code
+static std::vector<byte> memory_rom() {
+	return make_rom({
+		0xA300, // LD I, 0x300
+		0x7A01, // ADD VA, 1
+		0xFA33, // LD B, VA
+		0xFF55, // LD [I], VF
+		0xFF65, // LD VF, [I]
+		0xF755, // LD [I], V7
+		0xF365, // LD V3, [I]
+		0x1202, // JP 0x202
+	});
+}
+
+// SUPER-CHIP high resolution drawing: big digits, 16x16 sprites and a scroll between them
+static std::vector<byte> hires_rom() {
+	return make_rom({
+		0x00FF, // HIGH
+		0x6000, // LD V0, 0
+		0x6100, // LD V1, 0
+		0xC20F, // RND V2, 0x0F
+		0xF230, // LD HF, V2
+		0xD01A, // DRW V0, V1, 10
+		0xA200, // LD I, 0x200
+		0xD120, // DRW V1, V2, 0
+		0x7005, // ADD V0, 5
+		0x7103, // ADD V1, 3
+		0x00FB, // SCR
+		0x1206, // JP 0x206
+	});
+}
+
+// Upscale a full 640x320 frame, the old way (one get_pixel_value call per output pixel) and with Scaler
+static void bench_scaler(const Chip8& emu) {
+	const int frames = 2000;
+	const int scale = 10;
+	const int width = SCREEN_WIDTH * scale;
+	std::vector<uint32_t> pixels(width * SCREEN_HEIGHT * scale);
+
+	auto start_time = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; frame++) {
+		for (int y = 0; y < SCREEN_HEIGHT; y++) {
+			for (int x = 0; x < SCREEN_WIDTH; x++) {
+				for (int py = 0; py < scale; py++) {
+					for (int px = 0; px < scale; px++) {
+						pixels[(y * scale + py) * width + x * scale + px] = emu.get_pixel_value(x, y) ? 0x00FFFFFF : 0;
+					}
+				}
+			}
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+	std::cout << "scale 640x320 (per pixel): " << (elapsed.count() / frames) * 1e9 << " ns/frame" << std::endl;
+
+	Scaler scaler(scale, scale, 0, 0x00FFFFFF);
+	start_time = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; frame++) {
+		scaler.scale(emu.get_screen_rows(), SCREEN_WIDTH, SCREEN_HEIGHT, ~0ull, pixels.data(), width);
+	}
+	elapsed = std::chrono::steady_clock::now() - start_time;
+	std::cout << "scale 640x320 (scaler): " << (elapsed.count() / frames) * 1e9 << " ns/frame" << std::endl;
+
+	// The high resolution screen with both XO-CHIP planes, to the same window
+	Scaler hires_scaler(scale / 2, scale / 2, 0, 0x00FFFFFF);
+	start_time = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; frame++) {
+		hires_scaler.scale_planes(emu.get_screen_rows(0), emu.get_screen_rows(1), HIRES_SCREEN_WIDTH, HIRES_SCREEN_HEIGHT,
+			~0ull, pixels.data(), width);
+	}
+	elapsed = std::chrono::steady_clock::now() - start_time;
+	std::cout << "scale 640x320 (scaler, 128x64, 2 planes): " << (elapsed.count() / frames) * 1e9 << " ns/frame" << std::endl;
+}
+
+// Sound samples for a rom that keeps the XO-CHIP pattern playing, generated every frame and drained
+// from the ring like a sink would
+static void bench_audio(BenchHost& host) {
+	const int frames = 20000;
+	std::vector<byte> rom = make_rom({
+		0xA20C, // LD I, 0x20C
+		0xF002, // LD AUDIO, [I]
+		0x6010, // LD V0, 16
+		0xF018, // LD ST, V0
+		0xF03A, // LD PITCH, V0
+		0x1206, // JP 0x206
+		0xF0F0, 0xF0F0, 0xF0F0, 0xF0F0, 0xF0F0, 0xF0F0, 0xF0F0, 0xF0F0, // Audio pattern
+	});
+	Chip8 emu(rom.data(), rom.size(), host);
+	emu.set_variant(VARIANT_XOCHIP);
+	AudioRing ring;
+	Beeper beeper(ring, AUDIO_SAMPLE_RATE, 540);
+	int16_t samples[AUDIO_SAMPLE_RATE / 60];
+
+	long long allocations = allocation_count;
+	auto start_time = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; frame++) {
+		beeper.begin_frame(emu);
+		emu.run(9);
+		// The bench host doesn't pass sound changes on, so the change is at the end of the frame
+		beeper.sound_changed(emu);
+		beeper.end_frame(emu);
+		emu.step_clocks();
+		ring.pop(samples, AUDIO_SAMPLE_RATE / 60);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+	allocations = allocation_count - allocations;
+	std::cout << "audio (" << AUDIO_SAMPLE_RATE / 60 << " samples/frame): " << (elapsed.count() / frames) * 1e9
+		<< " ns/frame, " << allocations << " allocations, " << ring.get_dropped_samples() << " dropped" << std::endl;
+}
+
+// Many machines running 540Hz frames, as separate Chip8 objects and as the lanes of one Chip8Batch
+static void bench_batch(const std::vector<byte>& rom, BenchHost& host) {
+	const int machines = 1024;
+	const int frames = 2000;
+	const int instructions_per_frame = 9;
+	const double total = (double)machines * frames * instructions_per_frame;
+
+	{
+		std::vector<std::unique_ptr<Chip8>> emus;
+		for (int i = 0; i < machines; i++) {
+			emus.emplace_back(new Chip8(rom.data(), rom.size(), host));
+		}
+		auto start_time = std::chrono::steady_clock::now();
+		for (int frame = 0; frame < frames; frame++) {
+			for (std::unique_ptr<Chip8>& emu : emus) {
+				emu->run(instructions_per_frame);
+				emu->step_clocks();
+			}
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+		std::cout << "alu x" << machines << " (Chip8): " << (total / elapsed.count()) / 1e6 << " M instructions/s, "
+			<< sizeof(Chip8) + Chip8::get_variant_memory_size(VARIANT_CHIP8) << " bytes/machine" << std::endl;
+	}
+
+	{
+		Chip8Batch batch(rom.data(), rom.size(), std::vector<Chip8Host*>(machines, &host));
+		auto start_time = std::chrono::steady_clock::now();
+		for (int frame = 0; frame < frames; frame++) {
+			batch.run(instructions_per_frame);
+			batch.step_clocks();
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+		std::cout << "alu x" << machines << " (Chip8Batch): " << (total / elapsed.count()) / 1e6 << " M instructions/s, "
+			<< batch.get_memory_usage() / machines << " bytes/machine" << std::endl;
+	}
+}
+
+// Checkpointing a session: save and load a savestate
+static void bench_savestate(const std::vector<byte>& rom, BenchHost& host) {
+	const int iterations = 1000000;
+	Chip8 emu(rom.data(), rom.size(), host);
+	emu.run(1000);
+	Chip8Savestate savestate;
+
+	auto start_time = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		emu.save_state(savestate);
+		emu.load_state(savestate);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+	std::cout << "savestate save + load (" << emu.get_savestate_size() << " bytes): "
+		<< (elapsed.count() / iterations) * 1e9 << " ns" << std::endl;
+}
+
+// Record a minute of frames of a rom that draws every frame, then rewind all of it
+static void bench_rewind(BenchHost& host) {
+	const int frames = 60 * 60;
+	std::vector<byte> rom = sprite_rom();
+	Chip8 emu(rom.data(), rom.size(), host);
+	// Big enough that nothing is dropped, to measure how much a minute takes
+	RewindBuffer rewind(frames, 64 * 1024 * 1024);
+
+	std::chrono::duration<double> capture_time(0);
+	rewind.push(emu);
+	for (int i = 0; i < frames; i++) {
+		emu.run(9);
+		emu.step_clocks();
+		auto start_time = std::chrono::steady_clock::now();
+		rewind.push(emu);
+		capture_time += std::chrono::steady_clock::now() - start_time;
+	}
+	size_t bytes_per_minute = rewind.get_bytes_used();
+
+	auto start_time = std::chrono::steady_clock::now();
+	int steps = 0;
+	while (rewind.step_back(emu)) {
+		steps++;
+	}
+	std::chrono::duration<double> rewind_time = std::chrono::steady_clock::now() - start_time;
+
+	std::cout << "rewind: " << (capture_time.count() / frames) * 1e9 << " ns capture/frame, "
+		<< (rewind_time.count() / steps) * 1e9 << " ns step back, " << bytes_per_minute / 1024
+		<< " KB/minute (" << bytes_per_minute / frames << " bytes/frame, full state " << emu.get_savestate_size()
+		<< ")" << std::endl;
+}
+
+// Expand children of a search node (fork, then run a frame), by copying the whole interpreter and with
+// Chip8Fork, which keeps every child and runs them on one interpreter
+static void bench_fork(BenchHost& host) {
+	const int iterations = 20000;
+	std::vector<byte> rom = sprite_rom();
+	Chip8 emu(rom.data(), rom.size(), host);
+	emu.run(9);
+	emu.step_clocks();
+
+	{
+		auto start_time = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			Chip8 child(emu);
+			child.run(9);
+			child.step_clocks();
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+		std::cout << "fork (copy Chip8): " << (iterations / elapsed.count()) / 1e3 << " K children/s, "
+			<< sizeof(Chip8) + Chip8::get_variant_memory_size(VARIANT_CHIP8) << " bytes/child" << std::endl;
+	}
+
+	{
+		Chip8Fork parent(emu);
+		Chip8 worker(emu);
+		std::vector<Chip8Fork> children;
+		children.reserve(iterations);
+		size_t child_bytes = 0;
+
+		auto start_time = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			parent.restore(worker);
+			worker.run(9);
+			worker.step_clocks();
+			children.emplace_back(worker, parent);
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+		for (const Chip8Fork& child : children) {
+			child_bytes += sizeof(Chip8Fork) + child.get_private_bytes();
+		}
+		std::cout << "fork (Chip8Fork): " << (iterations / elapsed.count()) / 1e3 << " K children/s, "
+			<< child_bytes / iterations << " bytes/child" << std::endl;
+
+		start_time = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			children[i] = Chip8Fork(parent);
+		}
+		elapsed = std::chrono::steady_clock::now() - start_time;
+		std::cout << "fork (copy Chip8Fork): " << (iterations / elapsed.count()) / 1e6 << " M forks/s" << std::endl;
+	}
+}
+
+// Run a rom the way the frontend does at the default 540Hz: frames of 9 instructions, each ending
+// early when the rom draws or waits for a key, followed by a timer tick
+static void bench_workload(const char* name, const std::vector<byte>& rom, BenchHost& host,
+	Chip8Variant variant = VARIANT_CHIP8) {
+	const int frames = 2000000;
+	const int instructions_per_frame = 540 / 60;
+	Chip8 emu(rom.data(), rom.size(), host);
+	emu.set_variant(variant);
+	emu.set_quirks(0);
+
+	long long allocations = allocation_count;
+	auto start_time = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; frame++) {
+		emu.run(instructions_per_frame);
+		emu.step_clocks();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+	allocations = allocation_count - allocations;
+
+	std::cout << name << " (" << dispatch_name() << "): " << (emu.get_cycle_count() / elapsed.count()) / 1e6
+		<< " M instructions/s, " << (elapsed.count() / frames) * 1e9 << " ns/frame, "
+		<< (frames / 60.0) / elapsed.count() << "x realtime, " << allocations << " allocations" << std::endl;
+}
+
+// A recorded game session, replayed as fast as possible
+static void bench_trace(const std::string& rom_filename, const std::string& movie_filename) {
+	Movie movie = Movie::load(movie_filename.c_str());
+	long long allocations = allocation_count;
+	MovieReplayResult result = replay_movie(rom_filename.c_str(), movie);
+	allocations = allocation_count - allocations;
+
+	std::cout << rom_filename << " (" << dispatch_name() << "): " << (result.instructions / result.seconds) / 1e6
+		<< " M instructions/s, " << (result.seconds / result.frames) * 1e9 << " ns/frame, " << allocations
+		<< " allocations" << (result.is_ok() ? "" : ", REPLAY FAILED") << std::endl;
+}
+
+int main(int argc, char** argv) {
+	bool workloads_only = false;
+	std::vector<std::pair<std::string, std::string>> traces;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--workloads") {
+			workloads_only = true;
+		} else if (arg == "--trace" && i + 2 < argc) {
+			traces.emplace_back(argv[i + 1], argv[i + 2]);
+			i += 2;
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--workloads] [--trace ROM_FILE MOVIE_FILE]..." << std::endl;
+			return 1;
+		}
+	}
+
+	BenchHost host;
+	try {
+		bench_workload("alu", alu_rom(), host);
+		bench_workload("sprite", sprite_rom(), host);
+		bench_workload("redraw", redraw_rom(), host);
+		bench_workload("call", call_rom(), host);
+		bench_workload("memory", memory_rom(), host);
+		bench_workload("hires", hires_rom(), host, VARIANT_SCHIP);
+		for (const auto& trace : traces) {
+			bench_trace(trace.first, trace.second);
+		}
+	}
+	catch (const std::runtime_error& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
+	if (workloads_only) {
+		return 0;
+	}
+
+	const long long instructions = 100000000;
+	std::vector<byte> rom = alu_rom();
+
+	{
+		Chip8 emu(rom.data(), rom.size(), host);
+		auto start_time = std::chrono::steady_clock::now();
+		for (long long i = 0; i < instructions; i++) {
+			emu.step();
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+		std::cout << "alu (" << dispatch_name() << ", step): " << (instructions / elapsed.count()) / 1e6
+			<< " M instructions/s" << std::endl;
+	}
+
+	{
+		Chip8 emu(rom.data(), rom.size(), host);
+		auto start_time = std::chrono::steady_clock::now();
+		emu.run(instructions);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+		std::cout << "alu (" << dispatch_name() << ", run): " << (instructions / elapsed.count()) / 1e6
+			<< " M instructions/s" << std::endl;
+	}
+
+	{
+		Chip8 emu(rom.data(), rom.size(), host);
+		Chip8Jit jit(emu);
+		auto start_time = std::chrono::steady_clock::now();
+		jit.run(instructions);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+		std::cout << "alu (jit): " << (instructions / elapsed.count()) / 1e6 << " M instructions/s" << std::endl;
+	}
+
+	bench_batch(rom, host);
+	bench_savestate(rom, host);
+	bench_rewind(host);
+	bench_fork(host);
+	bench_audio(host);
+
+	{
+		Chip8 emu(rom.data(), rom.size(), host);
+		bench_scaler(emu);
+	}
+	return 0;
+}
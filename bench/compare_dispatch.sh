@@ -0,0 +1,11 @@
+#!/bin/sh
+# Build the benchmark with every dispatch strategy and run the workloads with each. From the
+# repository root:
+#	sh bench/compare_dispatch.sh [--trace ROM_FILE MOVIE_FILE]...
+set -e
+out=${TMPDIR:-/tmp}
+for dispatch in SWITCH TABLE GOTO; do
+	g++ -std=c++17 -O2 -I. -DCHIP8_DISPATCH=CHIP8_DISPATCH_$dispatch -o "$out/chip8_bench_$dispatch" bench/bench.cpp \
+		audio.cpp chip8.cpp chip8_batch.cpp chip8_fork.cpp chip8_jit.cpp movie.cpp rewind.cpp scaler.cpp scheduler.cpp
+	"$out/chip8_bench_$dispatch" --workloads "$@"
+done
@@ -1,207 +1,901 @@
 #include "chip8.h"
-#include "windows_bindings.h"
 
-Chip8::Chip8(const char* rom_filename) {
-	// Read rom into memory
+const byte Chip8::font[FONT_SIZE] = {
+	0xF0, 0x90, 0x90, 0x90, 0xF0, // "0"
+	0x20, 0x60, 0x20, 0x20, 0x70, // "1"
+	0xF0, 0x10, 0xF0, 0x80, 0xF0, // "2"
+	0xF0, 0x10, 0xF0, 0x10, 0xF0, // "3"
+	0x90, 0x90, 0xF0, 0x10, 0x10, // "4"
+	0xF0, 0x80, 0xF0, 0x10, 0xF0, // "5"
+	0xF0, 0x80, 0xF0, 0x90, 0xF0, // "6"
+	0xF0, 0x10, 0x20, 0x40, 0x40, // "7"
+	0xF0, 0x90, 0xF0, 0x90, 0xF0, // "8"
+	0xF0, 0x90, 0xF0, 0x10, 0xF0, // "9"
+	0xF0, 0x90, 0xF0, 0x90, 0x90, // "A"
+	0xE0, 0x90, 0xE0, 0x90, 0xE0, // "B"
+	0xF0, 0x80, 0x80, 0x80, 0xF0, // "C"
+	0xE0, 0x90, 0x90, 0x90, 0xE0, // "D"
+	0xF0, 0x80, 0xF0, 0x80, 0xF0, // "E"
+	0xF0, 0x80, 0xF0, 0x80, 0x80, // "F"
+};
+
+const byte Chip8::big_font[BIG_FONT_SIZE] = {
+	0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // "0"
+	0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // "1"
+	0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // "2"
+	0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // "3"
+	0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // "4"
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // "5"
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // "6"
+	0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // "7"
+	0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // "8"
+	0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // "9"
+	0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // "A"
+	0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // "B"
+	0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // "C"
+	0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // "D"
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // "E"
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0, // "F"
+};
+
+Chip8::Chip8(const char* rom_filename, Chip8Host& host, uint64_t seed) : host(&host) {
+	this->seed = seed;
+	random.seed(seed);
+	memory.resize(MAX_MEM_SIZE);
+	std::copy(font, font + FONT_SIZE, memory.begin());
+	std::copy(big_font, big_font + BIG_FONT_SIZE, memory.begin() + FONT_SIZE);
+
+	// Read rom into memory. The variant isn't known yet, so this reads as much as XO-CHIP can address
+	// and only keeps memory large enough for the rom until set_variant.
 	std::ifstream rom_file(rom_filename, std::ios::in | std::ios::binary);
 	if (!rom_file.is_open()) {
 		throw std::runtime_error("Failed to open rom file");
 	}
-	rom_file.read((char*)&memory[512], MEM_SIZE - 512);
+	rom_file.read((char*)&memory[512], MAX_MEM_SIZE - 512);
+	memory.resize(std::max<size_t>(MEM_SIZE, 512 + rom_file.gcount()));
+	memory.shrink_to_fit();
 	rom_file.close();
 }
 
+Chip8::Chip8(const byte* rom, int rom_size, Chip8Host& host, uint64_t seed) : host(&host) {
+	this->seed = seed;
+	random.seed(seed);
+	if (rom_size > MAX_MEM_SIZE - 512) {
+		throw std::runtime_error("Rom is too large to fit in memory");
+	}
+	memory.resize(std::max(MEM_SIZE, 512 + rom_size));
+	std::copy(font, font + FONT_SIZE, memory.begin());
+	std::copy(big_font, big_font + BIG_FONT_SIZE, memory.begin() + FONT_SIZE);
+	std::copy(rom, rom + rom_size, memory.begin() + 512);
+}
+
+Chip8::Chip8(const Chip8Savestate& savestate, Chip8Host& host) : host(&host) {
+	load_state(savestate);
+}
+
+Chip8Opcode Chip8::decode(short instr, Chip8Variant variant) {
+	bool schip = variant != VARIANT_CHIP8; // XO-CHIP extends SUPER-CHIP
+	bool xochip = variant == VARIANT_XOCHIP;
+	switch ((instr >> 12) & 0xF) {
+	case 0x0: {
+		if (instr == 0x00E0) {
+			return OP_00E0;
+		} else if (instr == 0x00EE) {
+			return OP_00EE;
+		} else if (schip && (instr & 0xFFF0) == 0x00C0) {
+			return OP_00Cn;
+		} else if (xochip && (instr & 0xFFF0) == 0x00D0) {
+			return OP_00Dn;
+		} else if (schip && instr == 0x00FB) {
+			return OP_00FB;
+		} else if (schip && instr == 0x00FC) {
+			return OP_00FC;
+		} else if (schip && instr == 0x00FD) {
+			return OP_00FD;
+		} else if (schip && instr == 0x00FE) {
+			return OP_00FE;
+		} else if (schip && instr == 0x00FF) {
+			return OP_00FF;
+		} else {
+			return OP_0nnn;
+		}
+	}
+	case 0x1: return OP_1nnn;
+	case 0x2: return OP_2nnn;
+	case 0x3: return OP_3xkk;
+	case 0x4: return OP_4xkk;
+	case 0x5: {
+		if (xochip && (instr & 0xF) == 0x2) {
+			return OP_5xy2;
+		} else if (xochip && (instr & 0xF) == 0x3) {
+			return OP_5xy3;
+		}
+		return OP_5xy0;
+	}
+	case 0x6: return OP_6xkk;
+	case 0x7: return OP_7xkk;
+	case 0x8: {
+		switch (instr & 0xF) {
+		case 0x0: return OP_8xy0;
+		case 0x1: return OP_8xy1;
+		case 0x2: return OP_8xy2;
+		case 0x3: return OP_8xy3;
+		case 0x4: return OP_8xy4;
+		case 0x5: return OP_8xy5;
+		case 0x6: return OP_8xy6;
+		case 0x7: return OP_8xy7;
+		case 0xE: return OP_8xyE;
+		default: return OP_unknown_8xyn;
+		}
+	}
+	case 0x9: return OP_9xy0;
+	case 0xA: return OP_Annn;
+	case 0xB: return OP_Bnnn;
+	case 0xC: return OP_Cxkk;
+	case 0xD: return (schip && (instr & 0xF) == 0) ? OP_Dxy0 : OP_Dxyn;
+	case 0xE: {
+		switch (instr & 0xFF) {
+		case 0x9E: return OP_Ex9E;
+		case 0xA1: return OP_ExA1;
+		default: return OP_unknown_Exkk;
+		}
+	}
+	default: {
+		if (xochip && (instr & 0xFFFF) == 0xF000) {
+			return OP_F000;
+		} else if (xochip && (instr & 0xFFFF) == 0xF002) {
+			return OP_F002;
+		}
+		switch (instr & 0xFF) {
+		case 0x01: return xochip ? OP_Fn01 : OP_unknown_Fxkk;
+		case 0x07: return OP_Fx07;
+		case 0x0A: return OP_Fx0A;
+		case 0x15: return OP_Fx15;
+		case 0x18: return OP_Fx18;
+		case 0x1E: return OP_Fx1E;
+		case 0x29: return OP_Fx29;
+		case 0x30: return schip ? OP_Fx30 : OP_unknown_Fxkk;
+		case 0x33: return OP_Fx33;
+		case 0x3A: return xochip ? OP_Fx3A : OP_unknown_Fxkk;
+		case 0x55: return OP_Fx55;
+		case 0x65: return OP_Fx65;
+		case 0x75: return schip ? OP_Fx75 : OP_unknown_Fxkk;
+		case 0x85: return schip ? OP_Fx85 : OP_unknown_Fxkk;
+		default: return OP_unknown_Fxkk;
+		}
+	}
+	}
+}
+
+Chip8Instruction Chip8::decode_at(int addr) const {
+	Chip8Instruction instr = decode_at(memory.data(), addr, variant);
+	// LD I, long addr (F000 NNNN) is the only instruction that is 4 bytes long, and XO-CHIP skips over
+	// all of it
+	if (variant == VARIANT_XOCHIP && addr + 3 < memory_size && memory[addr + 2] == 0xF0 && memory[addr + 3] == 0x00) {
+		instr.skip = 4;
+	}
+	return instr;
+}
+
+Chip8Instruction Chip8::decode_at(const byte* memory, int addr, Chip8Variant variant) {
+	// An instruction is 2 bytes long, big-endian
+	short raw = (memory[addr] << 8) | memory[addr + 1];
+
+	Chip8Instruction instr;
+	instr.opcode = decode(raw, variant);
+	instr.x = (raw >> 8) & 0xF;
+	instr.y = (raw >> 4) & 0xF;
+	instr.n = raw & 0xF;
+	instr.kk = raw & 0xFF;
+	instr.skip = 2;
+	instr.nnn = raw & 0xFFF;
+	return instr;
+}
+
+Chip8Instruction Chip8::decode_fused(int addr) const {
+	Chip8Instruction first = decode_at(addr);
+	if (addr + 3 >= memory_size) {
+		return first;
+	}
+	Chip8Instruction second = decode_at(addr + 2);
+
+	// LD Vx, byte; LD Vy, byte
+	if (first.opcode == OP_6xkk && second.opcode == OP_6xkk) {
+		Chip8Instruction fused = first;
+		fused.opcode = OP_6xkk_6xkk;
+		fused.y = second.x;
+		fused.nnn = second.kk;
+		return fused;
+	}
+	// LD I, addr; DRW Vx, Vy, nibble
+	if (first.opcode == OP_Annn && second.opcode == OP_Dxyn) {
+		Chip8Instruction fused = second;
+		fused.opcode = OP_Annn_Dxyn;
+		fused.nnn = first.nnn;
+		return fused;
+	}
+
+	if (addr + 5 >= memory_size) {
+		return first;
+	}
+	Chip8Instruction third = decode_at(addr + 4);
+	// ADD Vx, byte or LD Vx, DT; SE Vx, byte; JP addr. The body of almost every delay loop.
+	if ((first.opcode == OP_7xkk || first.opcode == OP_Fx07) && second.opcode == OP_3xkk && second.x == first.x
+		&& third.opcode == OP_1nnn) {
+		Chip8Instruction fused = first;
+		fused.opcode = (first.opcode == OP_7xkk) ? OP_7xkk_3xkk_1nnn : OP_Fx07_3xkk_1nnn;
+		fused.y = second.kk;
+		fused.nnn = third.nnn;
+		return fused;
+	}
+	return first;
+}
+
+bool Chip8::can_fuse(int length) const {
+	return cycle_count + length <= fusion_end_cycle;
+}
+
+void Chip8::invalidate_code(int addr, int size) {
+	// An instruction (or superinstruction) starting before the write can overlap it as well
+	int first = std::max(addr - (2 * CHIP8_FUSED_MAX_LENGTH - 1), 0);
+	int last = std::min(addr + size, memory_size);
+	for (int i = first; i < last; i++) {
+		decoded_instructions[i].opcode = OP_NOT_DECODED;
+	}
+#ifdef CHIP8_SPRITE_CACHE
+	if (addr < sprite_cache_high && addr + size > sprite_cache_low) {
+		clear_sprite_cache();
+	}
+#endif
+}
+
+#define STOP_FLAG_DRAWN 1
+#define STOP_FLAG_KEY_WAIT 2
+#define STOP_FLAG_TRAP 4
+#define STOP_FLAG_IDLE 8
+#define STOP_FLAG_EXIT 16
+
 bool Chip8::is_screen_dirty() const {
-	return screen_dirty;
+	return stop_flags & STOP_FLAG_DRAWN;
+}
+
+uint64_t Chip8::get_dirty_rows() const {
+	return dirty_rows;
+}
+
+void Chip8::clear_dirty_rows() {
+	dirty_rows = 0;
+}
+
+bool Chip8::has_exited() const {
+	return exited;
+}
+
+int Chip8::get_screen_width() const {
+	return hires ? HIRES_SCREEN_WIDTH : SCREEN_WIDTH;
+}
+
+int Chip8::get_screen_height() const {
+	return hires ? HIRES_SCREEN_HEIGHT : SCREEN_HEIGHT;
+}
+
+int Chip8::get_words_per_row() const {
+	return hires ? HIRES_SCREEN_WIDTH / 64 : 1;
+}
+
+uint64_t Chip8::get_all_rows() const {
+	return hires ? ~0ull : (1ull << SCREEN_HEIGHT) - 1;
 }
 
 bool Chip8::get_pixel_value(int x, int y) const {
-	return screen[y * SCREEN_WIDTH + x];
+	return (screen[0][y * get_words_per_row() + x / 64] >> (63 - x % 64)) & 1;
+}
+
+uint64_t Chip8::get_screen_row(int y) const {
+	return screen[0][y * get_words_per_row()];
+}
+
+const uint64_t* Chip8::get_screen_rows(int plane) const {
+	return screen[plane];
+}
+
+uint64_t Chip8::get_screen_hash(uint64_t hash) const {
+	int words = get_screen_height() * get_words_per_row();
+	for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+		// The other planes only count once something is drawn on them, so screens that only use the
+		// first plane hash the same in every variant
+		if (plane > 0 && std::all_of(screen[plane], screen[plane] + words, [](uint64_t word) { return word == 0; })) {
+			continue;
+		}
+		for (int word = 0; word < words; word++) {
+			for (int i = 0; i < 8; i++) {
+				hash ^= (screen[plane][word] >> (i * 8)) & 0xFF;
+				hash *= 1099511628211ull;
+			}
+		}
+	}
+	return hash;
 }
 
+#ifdef CHIP8_PROFILE
+const Chip8Profile& Chip8::get_profile() const {
+	return *profile;
+}
+
+void Chip8::clear_profile() {
+	profile->clear();
+}
+#endif
+
 void Chip8::step_clocks() {
 	if (DT_register > 0) {
 		DT_register--;
 	}
 
-	if (ST_register > 0) { // TODO: Sound
-		//std::cerr << "Sound is not implemented" << std::endl;
+	if (ST_register > 0) {
 		ST_register--;
 	}
 }
 
-void Chip8::step() {
-	// Reset the dirty state, appropriate instructions will set it.
-	screen_dirty = false;
+Chip8StopReason Chip8::run(long long cycles) {
+	return run_with_quirks<false>(cycles, nullptr, nullptr);
+}
+
+Chip8StopReason Chip8::run_until(long long cycles, Chip8Condition condition, void* context) {
+	return run_with_quirks<true>(cycles, condition, context);
+}
 
-	if (PC_register + 1 > MEM_SIZE) {
-		throw std::runtime_error("Executing instructions out of bounds");
+template <bool check_condition>
+Chip8StopReason Chip8::run_with_quirks(long long cycles, Chip8Condition condition, void* context) {
+	typedef Chip8StopReason (Chip8::*run_function)(long long, Chip8Condition, void*);
+	static const run_function run_loops[CHIP8_QUIRK_SETS] = {
+		&Chip8::run_loop<check_condition, 0>, &Chip8::run_loop<check_condition, 1>,
+		&Chip8::run_loop<check_condition, 2>, &Chip8::run_loop<check_condition, 3>,
+		&Chip8::run_loop<check_condition, 4>, &Chip8::run_loop<check_condition, 5>,
+		&Chip8::run_loop<check_condition, 6>, &Chip8::run_loop<check_condition, 7>,
+	};
+	return (this->*run_loops[quirks])(cycles, condition, context);
+}
+
+void Chip8::step() {
+	if (run(1) == STOP_FAULT) {
+		throw std::runtime_error(get_trap_message(trap));
 	}
-	
-	// An instruction is 2 bytes long, big-endian
-	short instr = ((memory[PC_register] << 8) & 0xFF00 | (memory[PC_register + 1]));
+}
 
-	// Decode instruction
-	switch ((memory[PC_register] >> 4) & 0xF) {
-	case 0x0: {
-		if (instr == 0x00E0) {
-			instr_00E0(instr);
-		} else if (instr == 0x00EE) {
-			instr_00EE(instr);
-		} else {
-			instr_0nnn(instr);
+template <bool check_condition, int quirk_set>
+Chip8StopReason Chip8::run_loop(long long cycles, Chip8Condition condition, void* context) {
+	// Reset the stop state, appropriate instructions will set it.
+	stop_flags = 0;
+	trap = TRAP_NONE;
+
+	Chip8StopReason reason = STOP_CYCLES;
+	long long start_cycle = cycle_count;
+	long long end_cycle = cycle_count + cycles;
+	// Superinstructions would hide the instructions in them from breakpoints and conditions
+	fusion_end_cycle = (check_condition || breakpoint_count) ? 0 : end_cycle;
+	bool idle = false;
+	// Only set_variant resizes the decode cache, and no instruction calls it
+	Chip8Instruction* decoded = decoded_instructions.data();
+	while (cycle_count < end_cycle) {
+		if (breakpoint_count && cycle_count != start_cycle && breakpoints[PC_register]) {
+			reason = STOP_BREAKPOINT;
+			break;
 		}
-	} break;
-	case 0x1: {
-		instr_1nnn(instr);
-	} break;
-	case 0x2: {
-		instr_2nnn(instr);
-	} break;
-	case 0x3: {
-		instr_3xkk(instr);
-	} break;
-	case 0x4: { 
-		instr_4xkk(instr);
-	} break;
-	case 0x5: { 
-		instr_5xy0(instr);
-	} break;
-	case 0x6: { 
-		instr_6xkk(instr);
-	} break;
-	case 0x7: { 
-		instr_7xkk(instr);
-	} break;
-	case 0x8: {
-		switch (instr & 0xF) {
-		case 0x0: { 
-			instr_8xy0(instr);
-		} break;
-		case 0x1: { 
-			instr_8xy1(instr);
-		} break;
-		case 0x2: { 
-			instr_8xy2(instr);
-		} break;
-		case 0x3: { 
-			instr_8xy3(instr);
-		} break;
-		case 0x4: { 
-			instr_8xy4(instr);
-		} break;
-		case 0x5: { 
-			instr_8xy5(instr);
-		} break;
-		case 0x6: { 
-			instr_8xy6(instr);
-		} break;
-		case 0x7: { 
-			instr_8xy7(instr);
-		} break;
-		case 0xE: { 
-			instr_8xyE(instr);
-		} break;
-		default: {
-			throw std::runtime_error("Unknown 8xy? instruction.");
-			//std::cerr << "Unknown instruction: " << memory[PC_register] << ", " << memory[PC_register + 1] << std::endl;
-		} break;
+
+		if (PC_register + 1 >= memory_size) {
+			raise_trap(TRAP_PC_OUT_OF_BOUNDS);
+			reason = STOP_FAULT;
+			break;
 		}
-	} break;
-	case 0x9: { 
-		instr_9xy0(instr);
-	} break;
-	case 0xA: { 
-		instr_Annn(instr);
-	} break;
-	case 0xB: { 
-		instr_Bnnn(instr);
-	} break;
-	case 0xC: { 
-		instr_Cxkk(instr);
-	} break;
-	case 0xD: { 
-		instr_Dxyn(instr);
-	} break;
-	case 0xE: {
-		switch (memory[PC_register + 1]) {
-		case 0x9E: { 
-			instr_Ex9E(instr);
-		} break;
-		case 0xA1: { 
-			instr_ExA1(instr);
-		} break;
-		default: {
-			throw std::runtime_error("Unknown Ex?? instruction.");
-			//std::cerr << "Unknown instruction: " << memory[PC_register] << ", " << memory[PC_register + 1] << std::endl;
-		} break;
+
+		// Instructions are decoded the first time they are executed, and after the memory they are in is written to
+		Chip8Instruction& instr = decoded[PC_register];
+		if (instr.opcode == OP_NOT_DECODED) {
+			instr = decode_fused(PC_register);
 		}
-	} break;
-	case 0xF: {
-		switch (memory[PC_register + 1]) {
-		case 0x07: { 
-			instr_Fx07(instr);
-		} break;
-		case 0x0A: { 
-			instr_Fx0A(instr);
-		} break;
-		case 0x15: { 
-			instr_Fx15(instr);
-		} break;
-		case 0x18: { 
-			instr_Fx18(instr);
-		} break;
-		case 0x1E: { 
-			instr_Fx1E(instr);
-		} break;
-		case 0x29: { 
-			instr_Fx29(instr);
-		} break;
-		case 0x33: { 
-			instr_Fx33(instr);
-		} break;
-		case 0x55: { 
-			instr_Fx55(instr);
-		} break;
-		case 0x65: { 
-			instr_Fx65(instr);
-		} break;
-		default: {
-			throw std::runtime_error("Unknown Fx?? instruction.");
-			//std::cerr << "Unknown instruction: " << memory[PC_register] << ", " << memory[PC_register + 1] << std::endl;
-		} break;
+#ifdef CHIP8_PROFILE
+		profile->opcode_counts[instr.opcode]++;
+		profile->address_counts[PC_register]++;
+#endif
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_SWITCH
+		switch (instr.opcode) {
+#define CHIP8_HANDLER_CASE(name) case OP_##name: instr_##name(instr); break;
+#define CHIP8_QUIRK_HANDLER_CASE(name) case OP_##name: instr_##name<quirk_set>(instr); break;
+		CHIP8_INSTRUCTIONS_BY_QUIRKS(CHIP8_HANDLER_CASE, CHIP8_QUIRK_HANDLER_CASE)
+		CHIP8_FUSED_INSTRUCTIONS(CHIP8_QUIRK_HANDLER_CASE)
+#undef CHIP8_QUIRK_HANDLER_CASE
+#undef CHIP8_HANDLER_CASE
+		default: break;
+		}
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_TABLE
+		typedef void (Chip8::*instr_handler)(const Chip8Instruction&);
+		static const instr_handler handlers[OP_COUNT] = {
+			nullptr, // OP_NOT_DECODED
+#define CHIP8_HANDLER_ENTRY(name) &Chip8::instr_##name,
+#define CHIP8_QUIRK_HANDLER_ENTRY(name) &Chip8::instr_##name<quirk_set>,
+			CHIP8_INSTRUCTIONS_BY_QUIRKS(CHIP8_HANDLER_ENTRY, CHIP8_QUIRK_HANDLER_ENTRY)
+			CHIP8_FUSED_INSTRUCTIONS(CHIP8_QUIRK_HANDLER_ENTRY)
+#undef CHIP8_QUIRK_HANDLER_ENTRY
+#undef CHIP8_HANDLER_ENTRY
+		};
+		(this->*handlers[instr.opcode])(instr);
+#else
+		static void* const handler_labels[OP_COUNT] = {
+			nullptr, // OP_NOT_DECODED
+#define CHIP8_HANDLER_LABEL(name) &&handle_##name,
+			CHIP8_INSTRUCTIONS(CHIP8_HANDLER_LABEL)
+			CHIP8_FUSED_INSTRUCTIONS(CHIP8_HANDLER_LABEL)
+#undef CHIP8_HANDLER_LABEL
+		};
+		goto *handler_labels[instr.opcode];
+#define CHIP8_HANDLER_CASE(name) handle_##name: instr_##name(instr); goto dispatched;
+#define CHIP8_QUIRK_HANDLER_CASE(name) handle_##name: instr_##name<quirk_set>(instr); goto dispatched;
+		CHIP8_INSTRUCTIONS_BY_QUIRKS(CHIP8_HANDLER_CASE, CHIP8_QUIRK_HANDLER_CASE)
+		CHIP8_FUSED_INSTRUCTIONS(CHIP8_QUIRK_HANDLER_CASE)
+#undef CHIP8_QUIRK_HANDLER_CASE
+#undef CHIP8_HANDLER_CASE
+dispatched:
+#endif
+
+		if (stop_flags & STOP_FLAG_TRAP) {
+			// The faulting instruction didn't execute, PC stays on it
+			reason = STOP_FAULT;
+			break;
+		}
+
+		PC_register += 2;
+		cycle_count++;
+
+		if (stop_flags == STOP_FLAG_IDLE) {
+			stop_flags = 0;
+			// Every iteration of the loop leaves the machine in the same state until the timers tick, so
+			// whole iterations can be skipped. The few instructions left over still run normally, so the
+			// machine ends up exactly where running every instruction would have left it. Breakpoints
+			// and conditions have to see every instruction.
+			if (!check_condition && !breakpoint_count) {
+				long long idle_cycles = (end_cycle - cycle_count) / 3 * 3;
+				cycle_count += idle_cycles;
+				idle_cycle_count += idle_cycles;
+#ifdef CHIP8_PROFILE
+				profile->idle_cycles += idle_cycles;
+#endif
+				idle = true;
+			}
+		} else if (stop_flags) {
+			reason = (stop_flags & STOP_FLAG_DRAWN) ? STOP_FRAME_DRAWN
+				: (stop_flags & STOP_FLAG_EXIT) ? STOP_EXIT : STOP_KEY_WAIT;
+			break;
+		}
+		if (check_condition && condition(*this, context)) {
+			reason = STOP_CONDITION;
+			break;
 		}
-	} break;
-	default: {
-		throw std::runtime_error("Unknown instruction.");
-		//std::cerr << "Unknown instruction: " << memory[PC_register] << ", " << memory[PC_register + 1] << std::endl;
-	} break;
 	}
 
-	PC_register += 2;
-	//PC_register = (PC_register) % MEM_SIZE; // Normalize PC
+	if (idle && reason == STOP_CYCLES) {
+		reason = STOP_IDLE;
+	}
+	return reason;
+}
+
+bool Chip8::is_timer_wait_loop(int addr) const {
+	if (addr > memory_size - 6) {
+		return false;
+	}
+	// LD Vx, DT
+	int x = memory[addr] & 0xF;
+	if ((memory[addr] >> 4) != 0xF || memory[addr + 1] != 0x07) {
+		return false;
+	}
+	// SE Vx, byte or SNE Vx, byte
+	if (memory[addr + 2] != (0x30 | x) && memory[addr + 2] != (0x40 | x)) {
+		return false;
+	}
+	// JP addr, back to the start
+	if (memory[addr + 4] != (0x10 | (addr >> 8)) || memory[addr + 5] != (addr & 0xFF)) {
+		return false;
+	}
+
+	// The loop only keeps going while the skip isn't taken, and Vx must already hold DT so the next
+	// iteration doesn't change it.
+	if (V_registers[x] != DT_register) {
+		return false;
+	}
+	bool skip_if_equal = (memory[addr + 2] >> 4) == 0x3;
+	return (DT_register == memory[addr + 3]) != skip_if_equal;
+}
+
+Chip8Trap Chip8::get_trap() const {
+	return trap;
+}
+
+const char* Chip8::get_trap_message(Chip8Trap trap) {
+	switch (trap) {
+	case TRAP_NONE: return "No fault";
+	case TRAP_PC_OUT_OF_BOUNDS: return "Executing instructions out of bounds";
+	case TRAP_STACK_OVERFLOW: return "CHIP-8 Only supports 16 levels of nested subroutines.";
+	case TRAP_STACK_UNDERFLOW: return "Too many RET instructions, nowhere to return to";
+	case TRAP_UNKNOWN_8xyn: return "Unknown 8xy? instruction.";
+	case TRAP_UNKNOWN_Exkk: return "Unknown Ex?? instruction.";
+	case TRAP_UNKNOWN_Fxkk: return "Unknown Fx?? instruction.";
+	case TRAP_DRAW_OUT_OF_BOUNDS: return "DRW Vx, Vy, nibble reads out of bounds";
+	case TRAP_STORE_BCD_OUT_OF_BOUNDS: return "LD B, Vx writes out of bounds";
+	case TRAP_STORE_REGISTERS_OUT_OF_BOUNDS: return "LD [I], Vx writes out of bounds";
+	case TRAP_LOAD_REGISTERS_OUT_OF_BOUNDS: return "LD Vx, [I] reads out of bounds";
+	case TRAP_LOAD_AUDIO_OUT_OF_BOUNDS: return "LD AUDIO, [I] reads out of bounds";
+	default: return "Unknown fault";
+	}
+}
+
+long long Chip8::get_cycle_count() const {
+	return cycle_count;
+}
+
+uint64_t Chip8::get_seed() const {
+	return seed;
+}
+
+byte Chip8::get_sound_timer() const {
+	return ST_register;
+}
+
+const byte* Chip8::get_audio_pattern() const {
+	return audio_pattern;
+}
+
+byte Chip8::get_pitch() const {
+	return pitch;
+}
+
+size_t Chip8::save_state(Chip8Savestate& savestate) const {
+	return save_state(&savestate, sizeof(savestate));
+}
+
+size_t Chip8::save_state(void* data, size_t size) const {
+	size_t savestate_size = get_savestate_size(memory_size);
+	if (size < savestate_size) {
+		throw std::runtime_error("Not enough room for the savestate");
+	}
+	Chip8SavestateHeader header;
+	std::memcpy(header.magic, "C8SS", 4);
+	header.version = CHIP8_SAVESTATE_VERSION;
+	header.state_size = sizeof(Chip8State);
+	header.memory_size = memory_size;
+	header.variant = variant;
+	header.quirks = quirks;
+	byte* out = (byte*)data;
+	std::memcpy(out + offsetof(Chip8Savestate, header), &header, sizeof(header));
+	std::memcpy(out + offsetof(Chip8Savestate, state), static_cast<const Chip8State*>(this), sizeof(Chip8State));
+	std::memcpy(out + offsetof(Chip8Savestate, memory), memory.data(), memory_size);
+	return savestate_size;
+}
+
+bool Chip8::is_valid_savestate(const void* data, size_t size) {
+	if (size < sizeof(Chip8SavestateHeader)) {
+		return false;
+	}
+	Chip8SavestateHeader header;
+	std::memcpy(&header, data, sizeof(header));
+	return std::memcmp(header.magic, "C8SS", 4) == 0 && header.version == CHIP8_SAVESTATE_VERSION
+		&& header.state_size == sizeof(Chip8State)
+		&& header.variant < VARIANT_COUNT && header.quirks < CHIP8_QUIRK_SETS
+		&& (int)header.memory_size == get_variant_memory_size((Chip8Variant)header.variant)
+		&& size == get_savestate_size(header.memory_size);
+}
+
+int Chip8::get_variant_memory_size(Chip8Variant variant) {
+	return (variant == VARIANT_XOCHIP) ? MAX_MEM_SIZE : MEM_SIZE;
+}
+
+size_t Chip8::get_savestate_size(int memory_size) {
+	return offsetof(Chip8Savestate, memory) + memory_size;
+}
+
+size_t Chip8::get_savestate_size() const {
+	return get_savestate_size(memory_size);
+}
+
+void Chip8::load_state(const void* data, size_t size) {
+	if (!is_valid_savestate(data, size)) {
+		throw std::runtime_error("Not a savestate of this version");
+	}
+	Chip8SavestateHeader header;
+	std::memcpy(&header, data, sizeof(header));
+	// Memory then has the size of the savestate's, and everything is decoded for its variant
+	if (header.variant != (uint32_t)variant) {
+		set_variant((Chip8Variant)header.variant);
+	}
+	if (header.quirks != (uint32_t)quirks) {
+		set_quirks(header.quirks);
+	}
+	// Memory can still hold a rom larger than the variant addresses when set_variant was never called
+	memory.resize(memory_size);
+
+	// Only code in memory that actually changed has to be decoded again, which is usually very little
+	// when going back and forth between states of the same session
+	const byte* new_memory = (const byte*)data + offsetof(Chip8Savestate, memory);
+	for (int block = 0; block < memory_size; block += 64) {
+		if (std::memcmp(&memory[block], new_memory + block, 64) == 0) {
+			continue;
+		}
+		for (int addr = block; addr < block + 64; addr += 8) {
+			uint64_t old_word, new_word;
+			std::memcpy(&old_word, &memory[addr], 8);
+			std::memcpy(&new_word, new_memory + addr, 8);
+			if (old_word != new_word) {
+				invalidate_code(addr, 8);
+			}
+		}
+	}
+	std::memcpy(static_cast<Chip8State*>(this), (const byte*)data + offsetof(Chip8Savestate, state), sizeof(Chip8State));
+	std::memcpy(memory.data(), new_memory, memory_size);
+
+	stop_flags = 0;
+	trap = TRAP_NONE;
+	dirty_rows = get_all_rows();
+	memory_generation++;
+}
+
+void Chip8::load_state(const Chip8Savestate& savestate) {
+	// A header with a bad memory size is rejected without reading past the savestate
+	size_t size = std::min(get_savestate_size(savestate.header.memory_size), sizeof(savestate));
+	load_state(&savestate, size);
+}
+
+void Chip8::save_state_file(const char* filename) const {
+	Chip8Savestate savestate;
+	size_t size = save_state(savestate);
+	std::ofstream file(filename, std::ios::out | std::ios::binary);
+	if (!file.write((const char*)&savestate, size)) {
+		throw std::runtime_error("Failed to write savestate file");
+	}
+}
+
+void Chip8::load_state_file(const char* filename) {
+	Chip8Savestate savestate;
+	std::ifstream file(filename, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to read savestate file");
+	}
+	// Savestates are shorter than Chip8Savestate when they don't have all of memory
+	file.read((char*)&savestate, sizeof(savestate));
+	size_t size = file.gcount();
+	if (file.bad() || (!file.eof() && file.peek() != EOF)) {
+		throw std::runtime_error("Failed to read savestate file");
+	}
+	load_state(&savestate, size);
+}
+
+int Chip8::get_memory_generation() const {
+	return memory_generation;
+}
+
+int Chip8::get_variant_quirks(Chip8Variant variant) {
+	switch (variant) {
+	case VARIANT_CHIP8: return CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_STORE_I | CHIP8_QUIRK_CLIP_SPRITES;
+	case VARIANT_SCHIP: return CHIP8_QUIRK_CLIP_SPRITES;
+	case VARIANT_XOCHIP: return CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_LOAD_STORE_I;
+	default: return 0;
+	}
+}
+
+const char* Chip8::get_variant_name(Chip8Variant variant) {
+	switch (variant) {
+	case VARIANT_CHIP8: return "chip8";
+	case VARIANT_SCHIP: return "schip";
+	case VARIANT_XOCHIP: return "xochip";
+	default: return "unknown";
+	}
+}
+
+void Chip8::set_variant(Chip8Variant variant) {
+	this->variant = variant;
+	memory_size = get_variant_memory_size(variant);
+	memory.resize(memory_size);
+	memory.shrink_to_fit();
+	// Instructions decode differently in every variant
+	decoded_instructions.assign(memory_size, Chip8Instruction());
+	set_quirks(get_variant_quirks(variant));
+}
+
+Chip8Variant Chip8::get_variant() const {
+	return variant;
+}
+
+void Chip8::set_quirks(int quirks) {
+	this->quirks = quirks & (CHIP8_QUIRK_SETS - 1);
+	memory_generation++;
+#ifdef CHIP8_SPRITE_CACHE
+	// Clipping changes how the rows are shifted
+	clear_sprite_cache();
+#endif
+}
+
+int Chip8::get_quirks() const {
+	return quirks;
 }
 
-#define ADDR(instr) ((instr)&0xFFF)
-#define X_REG(instr) ((instr>>8)&0xF)
-#define Y_REG(instr) ((instr>>4)&0xF)
-#define IMM_BYTE(instr) ((instr)&0xFF)
-#define IMM_NIBBLE(instr) ((instr)&0xF)
+long long Chip8::get_idle_cycle_count() const {
+	return idle_cycle_count;
+}
+
+bool Chip8::is_waiting_for_input() const {
+	return blocking_for_key && DT_register == 0 && ST_register == 0;
+}
+
+void Chip8::set_breakpoint(int addr, bool enabled) {
+	if (breakpoints.empty()) {
+		breakpoints.resize(MAX_MEM_SIZE);
+	}
+	if (breakpoints[addr] != enabled) {
+		breakpoints[addr] = enabled;
+		breakpoint_count += enabled ? 1 : -1;
+	}
+}
+
+void Chip8::clear_breakpoints() {
+	breakpoints.clear();
+	breakpoint_count = 0;
+}
+
+void Chip8::raise_trap(Chip8Trap trap) {
+	this->trap = trap;
+	stop_flags |= STOP_FLAG_TRAP;
+}
+
+#define ADDR(instr) ((instr).nnn)
+#define X_REG(instr) ((instr).x)
+#define Y_REG(instr) ((instr).y)
+#define IMM_BYTE(instr) ((instr).kk)
+#define IMM_NIBBLE(instr) ((instr).n)
+
+static inline uint64_t rotate_right(uint64_t value, int amount) {
+	return (value >> amount) | (value << ((64 - amount) & 63));
+}
+
+// The same for a 128 pixel row of the high resolution screen, split into its left and right words
+static inline void rotate_right(uint64_t& left, uint64_t& right, int amount) {
+	if (amount >= 64) {
+		std::swap(left, right);
+		amount -= 64;
+	}
+	if (amount) {
+		uint64_t new_left = (left >> amount) | (right << (64 - amount));
+		right = (right >> amount) | (left << (64 - amount));
+		left = new_left;
+	}
+}
+
+// Like rotate_right, but drops the pixels that go past the right edge
+static inline void shift_right(uint64_t& left, uint64_t& right, int amount) {
+	if (amount >= 64) {
+		right = left >> (amount - 64);
+		left = 0;
+	} else if (amount) {
+		right = (right >> amount) | (left << (64 - amount));
+		left >>= amount;
+	}
+}
 
 // SYS addr
-void Chip8::instr_0nnn(short instr) {
+void Chip8::instr_0nnn(const Chip8Instruction& instr) {
 	// Instruction ignored.
-	std::cout << "SYS instruction with address: " << ADDR(instr) << std::endl;
+	// Written with a single call so lines from interpreters on different threads don't interleave
+	std::cout << ("SYS instruction with address: " + std::to_string(ADDR(instr)) + "\n") << std::flush;
 }
 
 // CLS
-void Chip8::instr_00E0(short instr) {
-	for (int y = 0; y < SCREEN_HEIGHT; y++) {
-		for (int x = 0; x < SCREEN_WIDTH; x++) {
-			screen[y * SCREEN_WIDTH + x] = 0;
+void Chip8::instr_00E0(const Chip8Instruction& instr) {
+	int words_per_row = get_words_per_row();
+	int height = get_screen_height();
+	for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+		if (!((selected_planes >> plane) & 1)) {
+			continue;
+		}
+		for (int y = 0; y < height; y++) {
+			for (int word = 0; word < words_per_row; word++) {
+				if (screen[plane][y * words_per_row + word]) {
+					dirty_rows |= 1ull << y;
+				}
+				screen[plane][y * words_per_row + word] = 0;
+			}
 		}
 	}
-	screen_dirty = true;
+	stop_flags |= STOP_FLAG_DRAWN;
+}
+
+void Chip8::scroll_vertical(int rows) {
+	int words_per_row = get_words_per_row();
+	int words = get_screen_height() * words_per_row;
+	// Whole rows move, so this is a move of whole words
+	int moved = std::min(std::abs(rows) * words_per_row, words);
+	for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+		if (!((selected_planes >> plane) & 1)) {
+			continue;
+		}
+		uint64_t* plane_words = screen[plane];
+		if (rows > 0) {
+			std::memmove(plane_words + moved, plane_words, (words - moved) * sizeof(uint64_t));
+			std::memset(plane_words, 0, moved * sizeof(uint64_t));
+		} else {
+			std::memmove(plane_words, plane_words + moved, (words - moved) * sizeof(uint64_t));
+			std::memset(plane_words + words - moved, 0, moved * sizeof(uint64_t));
+		}
+	}
+	dirty_rows |= get_all_rows();
+	stop_flags |= STOP_FLAG_DRAWN;
+}
+
+void Chip8::scroll_horizontal(int pixels) {
+	int words_per_row = get_words_per_row();
+	int height = get_screen_height();
+	int amount = std::abs(pixels);
+	for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+		if (!((selected_planes >> plane) & 1)) {
+			continue;
+		}
+		for (int y = 0; y < height; y++) {
+			uint64_t* row = &screen[plane][y * words_per_row];
+			if (words_per_row == 1) {
+				row[0] = (pixels > 0) ? row[0] >> amount : row[0] << amount;
+			} else if (pixels > 0) {
+				row[1] = (row[1] >> amount) | (row[0] << (64 - amount));
+				row[0] >>= amount;
+			} else {
+				row[0] = (row[0] << amount) | (row[1] >> (64 - amount));
+				row[1] <<= amount;
+			}
+		}
+	}
+	dirty_rows |= get_all_rows();
+	stop_flags |= STOP_FLAG_DRAWN;
+}
+
+void Chip8::set_hires(bool enabled) {
+	hires = enabled;
+	std::memset(screen, 0, sizeof(screen));
+	dirty_rows = get_all_rows();
+	stop_flags |= STOP_FLAG_DRAWN;
+}
+
+// SCD nibble (SUPER-CHIP)
+void Chip8::instr_00Cn(const Chip8Instruction& instr) {
+	scroll_vertical(IMM_NIBBLE(instr));
+}
+
+// SCU nibble (XO-CHIP)
+void Chip8::instr_00Dn(const Chip8Instruction& instr) {
+	scroll_vertical(-IMM_NIBBLE(instr));
+}
+
+// SCR (SUPER-CHIP), by 4 pixels of the current resolution
+void Chip8::instr_00FB(const Chip8Instruction& instr) {
+	scroll_horizontal(4);
+}
+
+// SCL (SUPER-CHIP)
+void Chip8::instr_00FC(const Chip8Instruction& instr) {
+	scroll_horizontal(-4);
+}
+
+// EXIT (SUPER-CHIP)
+void Chip8::instr_00FD(const Chip8Instruction& instr) {
+	// Like LD Vx, K, this runs again every time the interpreter is resumed
+	exited = true;
+	PC_register -= 2;
+	stop_flags |= STOP_FLAG_EXIT;
+}
+
+// LOW (SUPER-CHIP)
+void Chip8::instr_00FE(const Chip8Instruction& instr) {
+	set_hires(false);
+}
+
+// HIGH (SUPER-CHIP)
+void Chip8::instr_00FF(const Chip8Instruction& instr) {
+	set_hires(true);
 }
 
 /*
@@ -210,94 +904,127 @@ we increment PC after each instruction. Relevant for JP, RET, CALL
 */
 
 // RET
-void Chip8::instr_00EE(short instr) {
-	PC_register = stack[SP_register];
-	if (SP_register == -1) {
-		throw std::runtime_error("Too many RET instructions, nowhere to return to");
+void Chip8::instr_00EE(const Chip8Instruction& instr) {
+	if (SP_register == 0xFF) {
+		raise_trap(TRAP_STACK_UNDERFLOW);
+		return;
 	}
+	PC_register = stack[SP_register];
 	SP_register--;
 }
 
 // JP addr
-void Chip8::instr_1nnn(short instr) {
+void Chip8::instr_1nnn(const Chip8Instruction& instr) {
+	// Only a jump back to the start of the loop can be the end of a timer wait loop
+	if (ADDR(instr) == PC_register - 4 && is_timer_wait_loop(ADDR(instr))) {
+		stop_flags |= STOP_FLAG_IDLE;
+	}
 	PC_register = ADDR(instr) - 2;
 }
 
 // CALL addr
-void Chip8::instr_2nnn(short instr) {
-	SP_register++;
-	if (SP_register > 15) {
-		throw std::runtime_error("CHIP-8 Only supports 16 levels of nested subroutines.");
+void Chip8::instr_2nnn(const Chip8Instruction& instr) {
+	if (SP_register == 15) {
+		raise_trap(TRAP_STACK_OVERFLOW);
+		return;
 	}
+	SP_register++;
 	stack[SP_register] = PC_register;
 	PC_register = ADDR(instr) - 2;
 }
 
 // JP V0, addr
-void Chip8::instr_Bnnn(short instr) {
+void Chip8::instr_Bnnn(const Chip8Instruction& instr) {
 	PC_register = ADDR(instr) + V_registers[0] - 2;
 }
 
 // SE Vx, byte
-void Chip8::instr_3xkk(short instr) {
+void Chip8::instr_3xkk(const Chip8Instruction& instr) {
 	if (V_registers[X_REG(instr)] == IMM_BYTE(instr)) {
-		PC_register += 2;
+		PC_register += instr.skip;
 	}
 }
 
 // SNE Vx, byte
-void Chip8::instr_4xkk(short instr) {
+void Chip8::instr_4xkk(const Chip8Instruction& instr) {
 	if (V_registers[X_REG(instr)] != IMM_BYTE(instr)) {
-		PC_register += 2;
+		PC_register += instr.skip;
 	}
 }
 
 // SE Vx, Vy
-void Chip8::instr_5xy0(short instr) {
+void Chip8::instr_5xy0(const Chip8Instruction& instr) {
 	if (V_registers[X_REG(instr)] == V_registers[Y_REG(instr)]) {
-		PC_register += 2;
+		PC_register += instr.skip;
+	}
+}
+
+// LD [I], Vx - Vy (XO-CHIP), in either direction, without changing I
+void Chip8::instr_5xy2(const Chip8Instruction& instr) {
+	int count = std::abs(X_REG(instr) - Y_REG(instr)) + 1;
+	if (I_register + count > memory_size) {
+		raise_trap(TRAP_STORE_REGISTERS_OUT_OF_BOUNDS);
+		return;
+	}
+	int step = (X_REG(instr) <= Y_REG(instr)) ? 1 : -1;
+	for (int i = 0; i < count; i++) {
+		memory[I_register + i] = V_registers[X_REG(instr) + i * step];
+	}
+	invalidate_code(I_register, count);
+}
+
+// LD Vx - Vy, [I] (XO-CHIP)
+void Chip8::instr_5xy3(const Chip8Instruction& instr) {
+	int count = std::abs(X_REG(instr) - Y_REG(instr)) + 1;
+	if (I_register + count > memory_size) {
+		raise_trap(TRAP_LOAD_REGISTERS_OUT_OF_BOUNDS);
+		return;
+	}
+	int step = (X_REG(instr) <= Y_REG(instr)) ? 1 : -1;
+	for (int i = 0; i < count; i++) {
+		V_registers[X_REG(instr) + i * step] = memory[I_register + i];
 	}
 }
 
 // LD Vx, byte
-void Chip8::instr_6xkk(short instr) {
+void Chip8::instr_6xkk(const Chip8Instruction& instr) {
 	V_registers[X_REG(instr)] = IMM_BYTE(instr);
 }
 
 // ADD Vx, byte
-void Chip8::instr_7xkk(short instr) {
+void Chip8::instr_7xkk(const Chip8Instruction& instr) {
 	V_registers[X_REG(instr)] += IMM_BYTE(instr);
 }
 
 // LD Vx, Vy
-void Chip8::instr_8xy0(short instr) {
+void Chip8::instr_8xy0(const Chip8Instruction& instr) {
 	V_registers[X_REG(instr)] = V_registers[Y_REG(instr)];
 }
 
 // OR Vx, Vy
-void Chip8::instr_8xy1(short instr) {
+void Chip8::instr_8xy1(const Chip8Instruction& instr) {
 	V_registers[X_REG(instr)] |= V_registers[Y_REG(instr)];
 }
 
 // AND Vx, Vy
-void Chip8::instr_8xy2(short instr) {
+void Chip8::instr_8xy2(const Chip8Instruction& instr) {
 	V_registers[X_REG(instr)] &= V_registers[Y_REG(instr)];
 }
 
 // XOR Vx, Vy
-void Chip8::instr_8xy3(short instr) {
+void Chip8::instr_8xy3(const Chip8Instruction& instr) {
 	V_registers[X_REG(instr)] ^= V_registers[Y_REG(instr)];
 }
 
 // ADD Vx, Vy
-void Chip8::instr_8xy4(short instr) {
+void Chip8::instr_8xy4(const Chip8Instruction& instr) {
 	short sum = ((short)V_registers[X_REG(instr)]) + ((short)V_registers[Y_REG(instr)]);
 	V_registers[0xF] = (sum > 255) ? 1 : 0; // Overflow
 	V_registers[X_REG(instr)] = sum & 0xFF;
 }
 
 // SUB Vx, Vy
-void Chip8::instr_8xy5(short instr) {
+void Chip8::instr_8xy5(const Chip8Instruction& instr) {
 	V_registers[0xF] = (V_registers[X_REG(instr)] >= V_registers[Y_REG(instr)]) ? 1 : 0;
 	V_registers[X_REG(instr)] -= V_registers[Y_REG(instr)];
 }
@@ -307,151 +1034,419 @@ void Chip8::instr_8xy5(short instr) {
 	were undocument opcodes which shifted Vy and stored the result in Vx.
 	Instead, modern interpreters chose to ignore Vy and just shift Vx. I am
 	conforming to the later standard because I assume the roms I have available
-	were written with that standard in mind.
+	were written with that standard in mind. The original behaviour is the
+	CHIP8_QUIRK_SHIFT_VY quirk.
 */
 
 // SHR Vx {, Vy}
-void Chip8::instr_8xy6(short instr) {
-	V_registers[0xF] = V_registers[X_REG(instr)] & 1;
-	V_registers[X_REG(instr)] >>= 1;
+template <int quirk_set>
+void Chip8::instr_8xy6(const Chip8Instruction& instr) {
+	int source = (quirk_set & CHIP8_QUIRK_SHIFT_VY) ? Y_REG(instr) : X_REG(instr);
+	V_registers[0xF] = V_registers[source] & 1;
+	V_registers[X_REG(instr)] = V_registers[source] >> 1;
 }
 
 // SHL Vx {, Vy}
-void Chip8::instr_8xyE(short instr) {
+template <int quirk_set>
+void Chip8::instr_8xyE(const Chip8Instruction& instr) {
 	// See SHR note
-	V_registers[0xF] = (V_registers[X_REG(instr)] >> 7) & 1;
-	V_registers[X_REG(instr)] <<= 1;
+	int source = (quirk_set & CHIP8_QUIRK_SHIFT_VY) ? Y_REG(instr) : X_REG(instr);
+	V_registers[0xF] = (V_registers[source] >> 7) & 1;
+	V_registers[X_REG(instr)] = V_registers[source] << 1;
 }
 
 // SUBN Vx, Vy
-void Chip8::instr_8xy7(short instr) {
+void Chip8::instr_8xy7(const Chip8Instruction& instr) {
 	V_registers[0xF] = (V_registers[Y_REG(instr)] >= V_registers[X_REG(instr)]) ? 1 : 0;
 	V_registers[X_REG(instr)] = V_registers[Y_REG(instr)] - V_registers[X_REG(instr)];
 }
 
 // SNE Vx, Vy
-void Chip8::instr_9xy0(short instr) {
+void Chip8::instr_9xy0(const Chip8Instruction& instr) {
 	if (V_registers[X_REG(instr)] != V_registers[Y_REG(instr)]) {
-		PC_register += 2;
+		PC_register += instr.skip;
 	}
 }
 
 // LD I, addr
-void Chip8::instr_Annn(short instr) {
+void Chip8::instr_Annn(const Chip8Instruction& instr) {
 	I_register = ADDR(instr);
 }
 
 // RND Vx, byte
-void Chip8::instr_Cxkk(short instr) {
-	V_registers[X_REG(instr)] = (rand() % 256) & IMM_BYTE(instr);
+void Chip8::instr_Cxkk(const Chip8Instruction& instr) {
+	V_registers[X_REG(instr)] = (random.next() >> 24) & IMM_BYTE(instr);
 }
 
 // DRW Vx, Vy, nibble
-void Chip8::instr_Dxyn(short instr) {
-	int base_x = V_registers[X_REG(instr)];
-	int base_y = V_registers[Y_REG(instr)];
-	for (int y = 0; y < IMM_NIBBLE(instr); y++) {
-		for (int x = 0; x < 8; x++) {
-			int pixel_value = (memory[I_register + y] >> (7 - x)) & 1;
-			int pos_x = (base_x + x) % SCREEN_WIDTH;
-			int pos_y = (base_y + y) % SCREEN_HEIGHT;
-			int pixel_index = pos_y * SCREEN_WIDTH + pos_x;
-
-			if (screen[pixel_index]) {
-				V_registers[0xF] = 1;
-			}
+template <int quirk_set>
+void Chip8::instr_Dxyn(const Chip8Instruction& instr) {
+	if (hires) {
+		draw_sprite<quirk_set, HIRES_SCREEN_WIDTH / 64>(instr, 1, IMM_NIBBLE(instr));
+	} else {
+		draw_sprite<quirk_set, 1>(instr, 1, IMM_NIBBLE(instr));
+	}
+}
 
-			screen[pixel_index] ^= pixel_value;
+// DRW Vx, Vy, 0 (SUPER-CHIP): a 16x16 sprite, 2 bytes per row
+template <int quirk_set>
+void Chip8::instr_Dxy0(const Chip8Instruction& instr) {
+	if (hires) {
+		draw_sprite<quirk_set, HIRES_SCREEN_WIDTH / 64>(instr, 2, 16);
+	} else {
+		draw_sprite<quirk_set, 1>(instr, 2, 16);
+	}
+}
+
+template <int quirk_set, int words_per_row>
+void Chip8::draw_sprite(const Chip8Instruction& instr, int sprite_bytes_per_row, int height) {
+	const int screen_width = 64 * words_per_row;
+	const int screen_height = (words_per_row == 1) ? SCREEN_HEIGHT : HIRES_SCREEN_HEIGHT;
+	// Every selected plane gets its own sprite, one after the other in memory
+	int sprite_size = sprite_bytes_per_row * height;
+	int plane_count = (selected_planes & 1) + ((selected_planes >> 1) & 1);
+	if (I_register + sprite_size * plane_count > memory_size) {
+		raise_trap(TRAP_DRAW_OUT_OF_BOUNDS);
+		return;
+	}
+
+	// The position wraps around the screen either way, only the pixels past the edges are clipped
+	int base_x = V_registers[X_REG(instr)] % screen_width;
+	int base_y = V_registers[Y_REG(instr)] % screen_height;
+	int rows = height;
+	if (quirk_set & CHIP8_QUIRK_CLIP_SPRITES) {
+		rows = std::min(rows, screen_height - base_y);
+	}
+	// Moves a row of sprite bits to the left edge of a word
+	int sprite_shift = 64 - 8 * sprite_bytes_per_row;
+	const byte* sprite = memory.data() + I_register;
+	uint64_t collision = 0;
+	for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+		if (!((selected_planes >> plane) & 1)) {
+			continue;
+		}
+#ifdef CHIP8_SPRITE_CACHE
+		const uint64_t* shifted_rows = nullptr;
+		if (words_per_row == 1 && sprite_bytes_per_row == 1) {
+			shifted_rows = get_shifted_sprite<quirk_set>(sprite - memory.data(), height, base_x);
+		}
+#endif
+		for (int y = 0; y < rows; y++) {
+			uint64_t sprite_bits = (sprite_bytes_per_row == 1) ? sprite[y] : (sprite[2 * y] << 8) | sprite[2 * y + 1];
+			int pos_y = (base_y + y) % screen_height;
+			uint64_t* screen_row = &screen[plane][pos_y * words_per_row];
+			// Place the sprite row at the left of the row and rotate it into position, which also
+			// wraps the pixels that go past the right edge. Shifting instead drops them.
+			uint64_t sprite_row = sprite_bits << sprite_shift;
+			if (words_per_row == 1) {
+#ifdef CHIP8_SPRITE_CACHE
+				if (shifted_rows) {
+					sprite_row = shifted_rows[y];
+				} else
+#endif
+				{
+					sprite_row = (quirk_set & CHIP8_QUIRK_CLIP_SPRITES)
+						? sprite_row >> base_x : rotate_right(sprite_row, base_x);
+				}
+				collision |= screen_row[0] & sprite_row;
+#ifdef CHIP8_PROFILE
+				profile->pixels_drawn += std::bitset<64>(sprite_row).count();
+				profile->pixels_erased += std::bitset<64>(screen_row[0] & sprite_row).count();
+#endif
+				screen_row[0] ^= sprite_row;
+				if (sprite_row) {
+					dirty_rows |= 1ull << pos_y;
+				}
+			} else {
+				uint64_t sprite_row_right = 0;
+				if (quirk_set & CHIP8_QUIRK_CLIP_SPRITES) {
+					shift_right(sprite_row, sprite_row_right, base_x);
+				} else {
+					rotate_right(sprite_row, sprite_row_right, base_x);
+				}
+				collision |= (screen_row[0] & sprite_row) | (screen_row[1] & sprite_row_right);
+#ifdef CHIP8_PROFILE
+				profile->pixels_drawn += std::bitset<64>(sprite_row).count() + std::bitset<64>(sprite_row_right).count();
+				profile->pixels_erased += std::bitset<64>(screen_row[0] & sprite_row).count()
+					+ std::bitset<64>(screen_row[1] & sprite_row_right).count();
+#endif
+				screen_row[0] ^= sprite_row;
+				screen_row[1] ^= sprite_row_right;
+				if (sprite_row | sprite_row_right) {
+					dirty_rows |= 1ull << pos_y;
+				}
+			}
 		}
+		sprite += sprite_size;
 	}
+	V_registers[0xF] = collision ? 1 : 0;
+#ifdef CHIP8_PROFILE
+	profile->collisions += collision ? 1 : 0;
+#endif
 
-	screen_dirty = true;
+	stop_flags |= STOP_FLAG_DRAWN;
 }
 
+#ifdef CHIP8_SPRITE_CACHE
+template <int quirk_set>
+const uint64_t* Chip8::get_shifted_sprite(int addr, int height, int x) {
+	Chip8SpriteCacheEntry& entry = sprite_cache[(addr * 67 + x * 5 + height) & (SPRITE_CACHE_ENTRIES - 1)];
+	if (entry.generation == sprite_cache_generation && entry.address == addr && entry.height == height
+		&& entry.x == x) {
+		return entry.rows;
+	}
+
+	for (int y = 0; y < height; y++) {
+		uint64_t sprite_row = (uint64_t)memory[addr + y] << 56;
+		entry.rows[y] = (quirk_set & CHIP8_QUIRK_CLIP_SPRITES) ? sprite_row >> x : rotate_right(sprite_row, x);
+	}
+	entry.generation = sprite_cache_generation;
+	entry.address = addr;
+	entry.height = height;
+	entry.x = x;
+	sprite_cache_low = std::min(sprite_cache_low, addr);
+	sprite_cache_high = std::max(sprite_cache_high, addr + height);
+	return entry.rows;
+}
+
+void Chip8::clear_sprite_cache() {
+	sprite_cache_generation++;
+	sprite_cache_low = MAX_MEM_SIZE;
+	sprite_cache_high = 0;
+}
+#endif
+
 // SKP Vx
-void Chip8::instr_Ex9E(short instr) {
-	if (is_key_down(V_registers[X_REG(instr)])) {
-		PC_register += 2;
+void Chip8::instr_Ex9E(const Chip8Instruction& instr) {
+	// There are only 16 keys, so only the low nibble of Vx selects one
+	if (host->is_key_down(V_registers[X_REG(instr)] & 0xF)) {
+		PC_register += instr.skip;
 	}
 }
 
 // SKNP Vx
-void Chip8::instr_ExA1(short instr) {
-	if (!is_key_down(V_registers[X_REG(instr)])) {
-		PC_register += 2;
+void Chip8::instr_ExA1(const Chip8Instruction& instr) {
+	if (!host->is_key_down(V_registers[X_REG(instr)] & 0xF)) {
+		PC_register += instr.skip;
+	}
+}
+
+// LD I, long addr (XO-CHIP): F000 followed by a 16-bit address
+void Chip8::instr_F000(const Chip8Instruction& instr) {
+	if (PC_register + 3 >= memory_size) {
+		raise_trap(TRAP_PC_OUT_OF_BOUNDS);
+		return;
+	}
+	I_register = (memory[PC_register + 2] << 8) | memory[PC_register + 3];
+	PC_register += 2;
+}
+
+// PLANE n (XO-CHIP)
+void Chip8::instr_Fn01(const Chip8Instruction& instr) {
+	selected_planes = X_REG(instr) & 3;
+}
+
+// LD AUDIO, [I] (XO-CHIP)
+void Chip8::instr_F002(const Chip8Instruction& instr) {
+	if (I_register + sizeof(audio_pattern) > (size_t)memory_size) {
+		raise_trap(TRAP_LOAD_AUDIO_OUT_OF_BOUNDS);
+		return;
 	}
+	std::memcpy(audio_pattern, &memory[I_register], sizeof(audio_pattern));
+	host->sound_changed(*this);
 }
 
 // LD Vx, DT
-void Chip8::instr_Fx07(short instr) {
+void Chip8::instr_Fx07(const Chip8Instruction& instr) {
 	V_registers[X_REG(instr)] = DT_register;
 }
 
 // LD Vx, K
-void Chip8::instr_Fx0A(short instr) {
+void Chip8::instr_Fx0A(const Chip8Instruction& instr) {
 	if (blocking_for_key) {
-		int key_number = get_capture_key();
+		int key_number = host->get_capture_key();
 		if (key_number != -1) {
 			V_registers[X_REG(instr)] = key_number;
 			blocking_for_key = false;
 		} else {
 			PC_register -= 2;
+			stop_flags |= STOP_FLAG_KEY_WAIT;
+#ifdef CHIP8_PROFILE
+			profile->key_wait_cycles++;
+#endif
 		}
 	} else {
 		blocking_for_key = true;
-		enable_key_capture();
+		host->enable_key_capture();
 		// We block by executing this instruction repeatedly until we capture a key press
-		PC_register -= 2; 
+		PC_register -= 2;
+		stop_flags |= STOP_FLAG_KEY_WAIT;
+#ifdef CHIP8_PROFILE
+		profile->key_wait_cycles++;
+#endif
 	}
 }
 
 // LD DT, Vx
-void Chip8::instr_Fx15(short instr) {
+void Chip8::instr_Fx15(const Chip8Instruction& instr) {
 	DT_register = V_registers[X_REG(instr)];
 }
 
 // LD ST, Vx
-void Chip8::instr_Fx18(short instr) {
+void Chip8::instr_Fx18(const Chip8Instruction& instr) {
 	ST_register = V_registers[X_REG(instr)];
+	host->sound_changed(*this);
 }
 
 // ADD I, Vx
-void Chip8::instr_Fx1E(short instr) {
+void Chip8::instr_Fx1E(const Chip8Instruction& instr) {
 	I_register += V_registers[X_REG(instr)];
 }
 
 // LD F, Vx
-void Chip8::instr_Fx29(short instr) {
+void Chip8::instr_Fx29(const Chip8Instruction& instr) {
 	// We store the font at the addr 0, and each sprite takes up 5 bytes.
 	I_register = 5 * V_registers[X_REG(instr)];
 }
 
+// LD HF, Vx (SUPER-CHIP)
+void Chip8::instr_Fx30(const Chip8Instruction& instr) {
+	// The big font follows the small one, 10 bytes per sprite
+	I_register = FONT_SIZE + 10 * (V_registers[X_REG(instr)] & 0xF);
+}
+
 // LD B, Vx
-void Chip8::instr_Fx33(short instr) {
-	if (I_register + 2 >= MEM_SIZE) {
-		throw std::runtime_error(" LD B, Vx writes out of bounds");
+void Chip8::instr_Fx33(const Chip8Instruction& instr) {
+	if (I_register + 2 >= memory_size) {
+		raise_trap(TRAP_STORE_BCD_OUT_OF_BOUNDS);
+		return;
 	}
 	memory[I_register] = V_registers[X_REG(instr)] / 100;
 	memory[I_register + 1] = (V_registers[X_REG(instr)] / 10) % 10;
 	memory[I_register + 2] = V_registers[X_REG(instr)] % 10;
+	invalidate_code(I_register, 3);
+}
+
+// LD PITCH, Vx (XO-CHIP)
+void Chip8::instr_Fx3A(const Chip8Instruction& instr) {
+	pitch = V_registers[X_REG(instr)];
+	host->sound_changed(*this);
 }
 
 // LD [I], Vx
-void Chip8::instr_Fx55(short instr) {
-	if (I_register + X_REG(instr) >= MEM_SIZE) {
-		throw std::runtime_error("LD [I], Vx writes out of bounds");
+template <int quirk_set>
+void Chip8::instr_Fx55(const Chip8Instruction& instr) {
+	if (I_register + X_REG(instr) >= memory_size) {
+		raise_trap(TRAP_STORE_REGISTERS_OUT_OF_BOUNDS);
+		return;
 	}
 	for (int i = 0; i <= X_REG(instr); i++) {
 		memory[I_register + i] = V_registers[i];
 	}
+	invalidate_code(I_register, X_REG(instr) + 1);
+	if (quirk_set & CHIP8_QUIRK_LOAD_STORE_I) {
+		I_register += X_REG(instr) + 1;
+	}
 }
 
 // LD Vx, [I]
-void Chip8::instr_Fx65(short instr) {
-	if (I_register + X_REG(instr) >= MEM_SIZE) {
-		throw std::runtime_error("LD Vx, [I] reads out of bounds");
+template <int quirk_set>
+void Chip8::instr_Fx65(const Chip8Instruction& instr) {
+	if (I_register + X_REG(instr) >= memory_size) {
+		raise_trap(TRAP_LOAD_REGISTERS_OUT_OF_BOUNDS);
+		return;
 	}
 	for (int i = 0; i <= X_REG(instr); i++) {
 		V_registers[i] = memory[I_register + i];
 	}
+	if (quirk_set & CHIP8_QUIRK_LOAD_STORE_I) {
+		I_register += X_REG(instr) + 1;
+	}
+}
+
+// LD R, Vx (SUPER-CHIP): save V0 to Vx in the flag registers
+void Chip8::instr_Fx75(const Chip8Instruction& instr) {
+	std::copy(V_registers, V_registers + X_REG(instr) + 1, flags);
+}
+
+// LD Vx, R (SUPER-CHIP)
+void Chip8::instr_Fx85(const Chip8Instruction& instr) {
+	std::copy(flags, flags + X_REG(instr) + 1, V_registers);
+}
+
+void Chip8::instr_unknown_8xyn(const Chip8Instruction& instr) {
+	raise_trap(TRAP_UNKNOWN_8xyn);
+}
+
+void Chip8::instr_unknown_Exkk(const Chip8Instruction& instr) {
+	raise_trap(TRAP_UNKNOWN_Exkk);
+}
+
+void Chip8::instr_unknown_Fxkk(const Chip8Instruction& instr) {
+	raise_trap(TRAP_UNKNOWN_Fxkk);
+}
+
+// Superinstructions. Each one leaves the machine exactly as its instructions would have, with PC
+// on the last instruction that ran, and counts every instruction but the last one (the run loop
+// counts that one). Without enough cycles left, only the first instruction runs.
+
+// LD Vx, byte; LD Vy, byte (with the second byte in nnn)
+template <int quirk_set>
+void Chip8::instr_6xkk_6xkk(const Chip8Instruction& instr) {
+	V_registers[X_REG(instr)] = IMM_BYTE(instr);
+	if (!can_fuse(2)) {
+		return;
+	}
+	V_registers[Y_REG(instr)] = (byte)ADDR(instr);
+	PC_register += 2;
+	cycle_count++;
+}
+
+// LD I, addr; DRW Vx, Vy, nibble
+template <int quirk_set>
+void Chip8::instr_Annn_Dxyn(const Chip8Instruction& instr) {
+	I_register = ADDR(instr);
+	if (!can_fuse(2)) {
+		return;
+	}
+	PC_register += 2;
+	cycle_count++;
+	instr_Dxyn<quirk_set>(instr);
+}
+
+// ADD Vx, byte; SE Vx, byte; JP addr (with the compared byte in y)
+template <int quirk_set>
+void Chip8::instr_7xkk_3xkk_1nnn(const Chip8Instruction& instr) {
+	V_registers[X_REG(instr)] += IMM_BYTE(instr);
+	if (!can_fuse(3)) {
+		return;
+	}
+	PC_register += 2;
+	cycle_count++;
+	if (V_registers[X_REG(instr)] == Y_REG(instr)) {
+		// Skips the jump
+		PC_register += 2;
+		return;
+	}
+	PC_register += 2;
+	cycle_count++;
+	instr_1nnn(instr);
+}
+
+// LD Vx, DT; SE Vx, byte; JP addr (with the compared byte in y)
+template <int quirk_set>
+void Chip8::instr_Fx07_3xkk_1nnn(const Chip8Instruction& instr) {
+	V_registers[X_REG(instr)] = DT_register;
+	if (!can_fuse(3)) {
+		return;
+	}
+	PC_register += 2;
+	cycle_count++;
+	if (V_registers[X_REG(instr)] == Y_REG(instr)) {
+		PC_register += 2;
+		return;
+	}
+	PC_register += 2;
+	cycle_count++;
+	instr_1nnn(instr);
 }
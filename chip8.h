@@ -11,95 +11,541 @@ A 0 B F      Z X C V
 */
 
 #include <iostream>
+#include <algorithm>
 #include <fstream>
 #include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
 #include <stdexcept>
+#include <bitset>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
 
+#include "chip8_host.h"
+#include "xoshiro.h"
+
+// Memory of CHIP-8 and SUPER-CHIP. XO-CHIP addresses all of MAX_MEM_SIZE.
 #define MEM_SIZE 4096
+#define MAX_MEM_SIZE 65536
 #define SCREEN_WIDTH 64
 #define SCREEN_HEIGHT 32
-typedef unsigned char byte;
-
-class Chip8 {
-	// The first 512 bytes of memory are reserved for the interpreter,
-	// we only use them to store font sprites.
-	byte memory[MEM_SIZE] = {
-		0xF0, 0x90, 0x90, 0x90, 0xF0, // "0"
-		0x20, 0x60, 0x20, 0x20, 0x70, // "1"
-		0xF0, 0x10, 0xF0, 0x80, 0xF0, // "2"
-		0xF0, 0x10, 0xF0, 0x10, 0xF0, // "3"
-		0x90, 0x90, 0xF0, 0x10, 0x10, // "4"
-		0xF0, 0x80, 0xF0, 0x10, 0xF0, // "5"
-		0xF0, 0x80, 0xF0, 0x90, 0xF0, // "6"
-		0xF0, 0x10, 0x20, 0x40, 0x40, // "7"
-		0xF0, 0x90, 0xF0, 0x90, 0xF0, // "8"
-		0xF0, 0x90, 0xF0, 0x10, 0xF0, // "9"
-		0xF0, 0x90, 0xF0, 0x90, 0x90, // "A"
-		0xE0, 0x90, 0xE0, 0x90, 0xE0, // "B"
-		0xF0, 0x80, 0x80, 0x80, 0xF0, // "C"
-		0xE0, 0x90, 0x90, 0x90, 0xE0, // "D"
-		0xF0, 0x80, 0xF0, 0x80, 0xF0, // "E"
-		0xF0, 0x80, 0xF0, 0x80, 0x80, // "F"
-	};
-	short stack[16] = {};
+// The SUPER-CHIP high resolution mode
+#define HIRES_SCREEN_WIDTH 128
+#define HIRES_SCREEN_HEIGHT 64
+// XO-CHIP draws on two bitplanes, which together pick one of four colors for every pixel
+#define SCREEN_PLANES 2
+// Words of a plane, enough for the high resolution screen
+#define SCREEN_WORDS (HIRES_SCREEN_WIDTH / 64 * HIRES_SCREEN_HEIGHT)
+// 16 hexadecimal digit sprites, 5 bytes each, stored at address 0
+#define FONT_SIZE 80
+// 16 large 8x10 digit sprites for SUPER-CHIP, stored right after the small ones
+#define BIG_FONT_SIZE 160
+
+// Every instruction is decoded once into a Chip8Instruction, whose opcode is the index of its
+// handler (a Chip8Opcode). How the run loop dispatches that opcode to the handler can be chosen at
+// build time with -DCHIP8_DISPATCH=... :
+// SWITCH - A switch statement on the opcode
+// TABLE  - An array of pointers to the handler member functions, indexed by the opcode
+// GOTO   - An array of labels indexed by the opcode, jumped to with computed goto (GCC/Clang only)
+#define CHIP8_DISPATCH_SWITCH 0
+#define CHIP8_DISPATCH_TABLE 1
+#define CHIP8_DISPATCH_GOTO 2
+#ifndef CHIP8_DISPATCH
+#if defined(__GNUC__)
+#define CHIP8_DISPATCH CHIP8_DISPATCH_GOTO
+#else
+#define CHIP8_DISPATCH CHIP8_DISPATCH_SWITCH
+#endif
+#endif
+
+// -DCHIP8_SPRITE_CACHE keeps the rows of recently drawn low resolution sprites already shifted into
+// position, keyed by (I, n, x), so redrawing one only XORs the words into the screen. Drawing is
+// already a shift per row without it, so the cache only won a few percent on the bench's redraw
+// workload and lost more on sprite, which draws at many positions. It is off by default.
+#ifdef CHIP8_SPRITE_CACHE
+#define SPRITE_CACHE_ENTRIES 256
+
+struct Chip8SpriteCacheEntry {
+	// The entry is only valid while this matches Chip8::sprite_cache_generation
+	int generation = -1;
+	unsigned short address = 0;
+	byte height = 0;
+	byte x = 0;
+	uint64_t rows[15];
+};
+#endif
+
+// Every CHIP-8 instruction handler, followed by the handlers for the groups with unknown encodings.
+// The handlers that behave differently depending on the quirks are passed to Q instead of X.
+#define CHIP8_BASE_INSTRUCTIONS_BY_QUIRKS(X, Q) \
+	X(0nnn) X(00E0) X(00EE) X(1nnn) X(2nnn) X(3xkk) X(4xkk) X(5xy0) X(6xkk) X(7xkk) \
+	X(8xy0) X(8xy1) X(8xy2) X(8xy3) X(8xy4) X(8xy5) Q(8xy6) X(8xy7) Q(8xyE) X(9xy0) \
+	X(Annn) X(Bnnn) X(Cxkk) Q(Dxyn) X(Ex9E) X(ExA1) X(Fx07) X(Fx0A) X(Fx15) X(Fx18) \
+	X(Fx1E) X(Fx29) X(Fx33) Q(Fx55) Q(Fx65) \
+	X(unknown_8xyn) X(unknown_Exkk) X(unknown_Fxkk)
+#define CHIP8_BASE_INSTRUCTIONS(X) CHIP8_BASE_INSTRUCTIONS_BY_QUIRKS(X, X)
+// The instructions SUPER-CHIP adds, then the ones XO-CHIP adds on top of those. They are only
+// decoded for those variants.
+#define CHIP8_EXTENDED_INSTRUCTIONS_BY_QUIRKS(X, Q) \
+	X(00Cn) X(00FB) X(00FC) X(00FD) X(00FE) X(00FF) Q(Dxy0) X(Fx30) X(Fx75) X(Fx85) \
+	X(00Dn) X(5xy2) X(5xy3) X(F000) X(Fn01) X(F002) X(Fx3A)
+#define CHIP8_INSTRUCTIONS_BY_QUIRKS(X, Q) CHIP8_BASE_INSTRUCTIONS_BY_QUIRKS(X, Q) CHIP8_EXTENDED_INSTRUCTIONS_BY_QUIRKS(X, Q)
+#define CHIP8_INSTRUCTIONS(X) CHIP8_INSTRUCTIONS_BY_QUIRKS(X, X)
+
+// Superinstructions: sequences that roms use all the time, fused into one handler when they are
+// decoded. They only ever appear in the interpreter's own decode cache.
+#define CHIP8_FUSED_INSTRUCTIONS(X) \
+	X(6xkk_6xkk) X(Annn_Dxyn) X(7xkk_3xkk_1nnn) X(Fx07_3xkk_1nnn)
+// The most instructions a superinstruction covers
+#define CHIP8_FUSED_MAX_LENGTH 3
+
+enum Chip8Opcode : unsigned char {
+	OP_NOT_DECODED, // Marks entries of the decoded instruction cache that have to be decoded again
+#define CHIP8_OPCODE_ENUM(name) OP_##name,
+	CHIP8_INSTRUCTIONS(CHIP8_OPCODE_ENUM)
+	CHIP8_FUSED_INSTRUCTIONS(CHIP8_OPCODE_ENUM)
+#undef CHIP8_OPCODE_ENUM
+	OP_COUNT
+};
+
+// Quirks are behaviours that differ between interpreters of the same instructions. A quirk set is a
+// combination of these bits. The run loop is compiled once for every quirk set, so handlers test
+// them at compile time.
+#define CHIP8_QUIRK_SHIFT_VY 1 // SHR/SHL shift Vy into Vx, instead of shifting Vx in place
+#define CHIP8_QUIRK_LOAD_STORE_I 2 // LD [I], Vx and LD Vx, [I] leave I after the last register
+#define CHIP8_QUIRK_CLIP_SPRITES 4 // DRW clips sprites at the edges of the screen instead of wrapping them
+#define CHIP8_QUIRK_SETS 8
+
+// The family of interpreters a rom was written for, which decides its usual quirks
+enum Chip8Variant {
+	VARIANT_CHIP8, // The original COSMAC VIP interpreter
+	VARIANT_SCHIP, // SUPER-CHIP 1.1 on the HP 48
+	VARIANT_XOCHIP, // XO-CHIP (Octo)
+	VARIANT_COUNT
+};
+
+// An instruction with its handler and operands already extracted. Superinstructions pack the
+// operands of all their instructions into these fields, see their handlers.
+struct Chip8Instruction {
+	byte opcode; // Chip8Opcode
+	byte x;
+	byte y;
+	byte n;
+	byte kk;
+	// How far SE/SNE/SKP/SKNP move PC when they skip: 2, or 4 over the long XO-CHIP LD I, addr
+	byte skip;
+	short nnn;
+};
+
+// Why Chip8::run returned
+enum Chip8StopReason {
+	STOP_CYCLES, // The cycle budget ran out
+	STOP_FRAME_DRAWN, // An instruction drew to the screen
+	STOP_KEY_WAIT, // LD Vx, K is waiting for a key press
+	STOP_FAULT, // An instruction trapped, see Chip8::get_trap. PC points at the faulting instruction.
+	STOP_BREAKPOINT, // PC reached a breakpoint, the instruction there was not executed yet
+	STOP_CONDITION, // The run_until condition was met
+	STOP_IDLE, // The program spins waiting for the delay timer, the rest of the budget was skipped
+	STOP_EXIT, // The program ended with EXIT (SUPER-CHIP). PC stays on it, so running again stops right away.
+};
+
+// Faults are reported as trap codes instead of exceptions, so the run loop doesn't have to deal with
+// unwinding. A faulting instruction leaves the machine state untouched.
+enum Chip8Trap {
+	TRAP_NONE,
+	TRAP_PC_OUT_OF_BOUNDS,
+	TRAP_STACK_OVERFLOW,
+	TRAP_STACK_UNDERFLOW,
+	TRAP_UNKNOWN_8xyn,
+	TRAP_UNKNOWN_Exkk,
+	TRAP_UNKNOWN_Fxkk,
+	TRAP_DRAW_OUT_OF_BOUNDS,
+	TRAP_STORE_BCD_OUT_OF_BOUNDS,
+	TRAP_STORE_REGISTERS_OUT_OF_BOUNDS,
+	TRAP_LOAD_REGISTERS_OUT_OF_BOUNDS,
+	TRAP_LOAD_AUDIO_OUT_OF_BOUNDS,
+};
+
+class Chip8;
+// Condition for Chip8::run_until, checked after every instruction
+typedef bool (*Chip8Condition)(const Chip8& emu, void* context);
+
+// Bump whenever Chip8State changes, so older savestates are rejected instead of misread
+#define CHIP8_SAVESTATE_VERSION 5
+
+/*
+The complete state of the machine apart from memory. It is plain data with no pointers, so a
+savestate is just a copy of it followed by memory, and loading one is two memcpys. The layout is the
+native one of the compiler, so savestates can be moved between processes running the same build,
+not between architectures.
+*/
+struct Chip8State {
+	unsigned short stack[16] = {};
 
 	byte V_registers[16] = {};
-	short I_register = 0;
+	unsigned short I_register = 0;
 
-	short PC_register = 512;
+	unsigned short PC_register = 512;
 	byte SP_register = -1; // The sp register is the top of the currently occupied stack: -1 means the stack is empty.
 	byte DT_register = 0;
 	byte ST_register = 0;
 
-	byte screen[SCREEN_WIDTH * SCREEN_HEIGHT] = {};
-	bool screen_dirty = false;
-
 	bool blocking_for_key = false;
+	// Set by EXIT
+	bool exited = false;
+
+	// Every row of the screen is packed into a word, with the leftmost pixel in the most significant
+	// bit, so a sprite row is drawn with a rotate and an XOR. The 128x64 SUPER-CHIP mode has two words
+	// per row, and the low resolution screen only uses the first 32 words of every plane.
+	uint64_t screen[SCREEN_PLANES][SCREEN_WORDS] = {};
+	// Bit y is set when row y changed since the last call to clear_dirty_rows
+	uint64_t dirty_rows = 0;
+	bool hires = false;
+	// The planes that drawing, clearing and scrolling apply to, bit p is plane p (XO-CHIP)
+	byte selected_planes = 1;
+
+	// The SUPER-CHIP persistent flag registers of LD R, Vx and LD Vx, R
+	byte flags[16] = {};
+	// The XO-CHIP audio pattern (1 bit per sample) and the pitch it plays at
+	byte audio_pattern[16] = {};
+	byte pitch = 64;
+
+	// Source of RND Vx, byte. Every interpreter has its own, so runs are reproducible from the seed.
+	uint64_t seed = 0;
+	Xoshiro128 random;
+
+	// Instructions executed since the interpreter was created
+	long long cycle_count = 0;
+	// How many of them were skipped because the program was waiting for the delay timer
+	long long idle_cycle_count = 0;
+};
+
+struct Chip8SavestateHeader {
+	char magic[4]; // "C8SS"
+	uint32_t version; // CHIP8_SAVESTATE_VERSION
+	uint32_t state_size; // sizeof(Chip8State)
+	uint32_t memory_size; // Bytes of memory in the savestate, the memory size of the variant
+	uint32_t variant; // Chip8Variant
+	uint32_t quirks; // CHIP8_QUIRK_* bits
+};
+
+// A savestate as it is stored in memory. Only the first Chip8::get_savestate_size bytes are part of
+// it, which is also all that is written to files. Memory comes last, so CHIP-8 and SUPER-CHIP
+// savestates stop after the first MEM_SIZE bytes instead of having the 64KB of XO-CHIP.
+struct Chip8Savestate {
+	Chip8SavestateHeader header;
+	Chip8State state;
+	byte memory[MAX_MEM_SIZE];
+};
+
+static_assert(std::is_trivially_copyable<Chip8Savestate>::value, "Savestates are copied with memcpy");
+
+#ifdef CHIP8_PROFILE
+// Bump whenever Chip8Profile changes, so tools reading binary profiles can tell
+#define CHIP8_PROFILE_VERSION 2
+
+/*
+Execution counts, collected when built with -DCHIP8_PROFILE to find out where a set of roms spends
+its time. Only instructions run by the interpreter are counted, not blocks run by Chip8Jit. Without
+CHIP8_PROFILE none of this exists and the run loop doesn't change.
+*/
+struct Chip8Profile {
+	// Executions of every handler (indexed by Chip8Opcode) and of the instruction at every address
+	long long opcode_counts[OP_COUNT] = {};
+	long long address_counts[MAX_MEM_SIZE] = {};
+	// Sprite pixels drawn by DRW, how many of those turned a pixel off, and how many DRWs set VF
+	long long pixels_drawn = 0;
+	long long pixels_erased = 0;
+	long long collisions = 0;
+	// Executions of LD Vx, K that found no key and have to run again
+	long long key_wait_cycles = 0;
+	// Instructions skipped by idle loop detection, which are not in the counts above
+	long long idle_cycles = 0;
+
+	void clear();
+	// Accumulate the counts of another profile, such as another rom of a corpus
+	void add(const Chip8Profile& other);
+	// Both throw std::runtime_error on errors. The CSV has a "section,name,count" line for every count
+	// that isn't zero. The binary file is a Chip8ProfileHeader followed by the profile as is.
+	void save_csv(const char* filename) const;
+	void save_binary(const char* filename) const;
+	static const char* get_opcode_name(int opcode);
+};
+
+struct Chip8ProfileHeader {
+	char magic[4]; // "C8PF"
+	uint32_t version; // CHIP8_PROFILE_VERSION
+	uint32_t opcode_count; // OP_COUNT
+	uint32_t memory_size; // MAX_MEM_SIZE
+};
+
+// The profile of an interpreter, kept on the heap since the address counts alone are 512KB. Copies
+// of the interpreter get a copy of the profile.
+class Chip8ProfileStorage {
+	std::unique_ptr<Chip8Profile> profile = std::unique_ptr<Chip8Profile>(new Chip8Profile());
 public:
-	// Construct CHIP8 interpreter with a rom file loaded into memory
-	Chip8(const char* rom_filename);
-	// Execute one instruction
+	Chip8ProfileStorage() {}
+	Chip8ProfileStorage(const Chip8ProfileStorage& other) : profile(new Chip8Profile(*other.profile)) {}
+	Chip8ProfileStorage& operator=(const Chip8ProfileStorage& other) {
+		*profile = *other.profile;
+		return *this;
+	}
+
+	Chip8Profile& operator*() const { return *profile; }
+	Chip8Profile* operator->() const { return profile.get(); }
+};
+#endif
+
+class Chip8 : private Chip8State {
+	// Set by instructions that have to stop the run loop (drawing, waiting for a key, faults)
+	byte stop_flags = 0;
+	Chip8Trap trap = TRAP_NONE;
+	// One flag per address, only allocated once a breakpoint is set
+	std::vector<bool> breakpoints;
+	int breakpoint_count = 0;
+
+	// The first 512 bytes of memory are reserved for the interpreter, we only use them to store font
+	// sprites. Only as large as the memory the variant addresses, so a CHIP-8 machine doesn't carry
+	// the 64KB of XO-CHIP around.
+	std::vector<byte> memory = std::vector<byte>(MEM_SIZE);
+
+	// The decoded instruction starting at every address of the memory of the variant
+	std::vector<Chip8Instruction> decoded_instructions = std::vector<Chip8Instruction>(MEM_SIZE);
+
+	Chip8Host* host;
+	// Incremented whenever memory is replaced as a whole or the quirks change, so caches outside the
+	// interpreter (the recompiler's blocks) know to throw everything away
+	int memory_generation = 0;
+	Chip8Variant variant = VARIANT_CHIP8;
+	// How much of memory the variant addresses
+	int memory_size = MEM_SIZE;
+	// CHIP8_QUIRK_* bits. None by default, which is how this interpreter always behaved.
+	int quirks = 0;
+	// Superinstructions only run while the cycle count stays at or below this, so they never
+	// overshoot the budget of a run or skip over an instruction that has to be seen on its own
+	long long fusion_end_cycle = 0;
+#ifdef CHIP8_PROFILE
+	Chip8ProfileStorage profile;
+#endif
+#ifdef CHIP8_SPRITE_CACHE
+	std::vector<Chip8SpriteCacheEntry> sprite_cache = std::vector<Chip8SpriteCacheEntry>(SPRITE_CACHE_ENTRIES);
+	// Incremented to empty the cache, when memory the cached sprites were read from (anything between
+	// low and high) is written or the quirks change
+	int sprite_cache_generation = 0;
+	int sprite_cache_low = MAX_MEM_SIZE;
+	int sprite_cache_high = 0;
+#endif
+
+	friend class Chip8Jit;
+public:
+	static const byte font[FONT_SIZE];
+	static const byte big_font[BIG_FONT_SIZE];
+
+	// Construct CHIP8 interpreter with a rom file loaded into memory. Input is provided by the
+	// host, which must outlive the interpreter. The seed decides the numbers RND generates.
+	Chip8(const char* rom_filename, Chip8Host& host, uint64_t seed = 0);
+	// Construct CHIP8 interpreter with a rom image that is already in memory
+	Chip8(const byte* rom, int rom_size, Chip8Host& host, uint64_t seed = 0);
+	// Construct CHIP8 interpreter from a savestate, throws std::runtime_error if it is invalid
+	Chip8(const Chip8Savestate& savestate, Chip8Host& host);
+	// Which handler executes the specified instruction on a variant
+	static Chip8Opcode decode(short instr, Chip8Variant variant = VARIANT_CHIP8);
+	// Decode the instruction starting at the specified address of a memory image. Skips are always
+	// decoded as 2 bytes long.
+	static Chip8Instruction decode_at(const byte* memory, int addr, Chip8Variant variant = VARIANT_CHIP8);
+	// Execute up to the specified number of instructions. Returns early when an instruction draws,
+	// waits for a key or faults, or when PC reaches a breakpoint (except at the first instruction).
+	// Loops that only wait for the delay timer (LD Vx, DT; SE/SNE Vx, byte; JP back) are detected and
+	// the rest of the budget is counted as executed without running them.
+	Chip8StopReason run(long long cycles);
+	// Like run, but also stops as soon as condition returns true after an instruction
+	Chip8StopReason run_until(long long cycles, Chip8Condition condition, void* context);
+	// Execute one instruction, throws std::runtime_error if it faults
 	void step();
+	// The fault that stopped the last run
+	Chip8Trap get_trap() const;
+	static const char* get_trap_message(Chip8Trap trap);
+	// Instructions executed since the interpreter was created. It is kept up to date during a run, so
+	// host callbacks see the number of instructions before the one that called them.
+	long long get_cycle_count() const;
+	// The seed the interpreter was created with
+	uint64_t get_seed() const;
+	// The sound plays while the sound timer is above 0. XO-CHIP plays the 128 bits of the audio
+	// pattern, most significant bit of the first byte first, at 4000 * 2^((pitch - 64) / 48) bits
+	// per second.
+	byte get_sound_timer() const;
+	const byte* get_audio_pattern() const;
+	byte get_pitch() const;
+
+	// Copy the machine state into a savestate and return its size. Only the memory the variant
+	// addresses is copied, the rest of savestate.memory is left as it was. Breakpoints and the
+	// host are not part of it.
+	size_t save_state(Chip8Savestate& savestate) const;
+	// The same into raw bytes, at least get_savestate_size() of them, which throws
+	// std::runtime_error if there aren't enough
+	size_t save_state(void* data, size_t size) const;
+	// Replace the machine state with a savestate, which can point straight into a mapped file.
+	// Throws std::runtime_error (and keeps the current state) if it isn't a valid savestate of
+	// this version. The machine switches to the variant and quirks of the savestate. The whole
+	// screen is marked dirty.
+	void load_state(const void* data, size_t size);
+	void load_state(const Chip8Savestate& savestate);
+	void save_state_file(const char* filename) const;
+	void load_state_file(const char* filename);
+	// Whether the data is a savestate this build can load
+	static bool is_valid_savestate(const void* data, size_t size);
+	// Bytes of a savestate: the header, the state and memory_size bytes of memory
+	static size_t get_savestate_size(int memory_size);
+	// Bytes of the savestates of this machine
+	size_t get_savestate_size() const;
+	// Changes every time the memory is replaced by loading a savestate, or the quirks change
+	int get_memory_generation() const;
+	// How many of the executed instructions were skipped by idle loop detection
+	long long get_idle_cycle_count() const;
+	// Whether nothing can change until a key is pressed: LD Vx, K is waiting and both timers ran out
+	bool is_waiting_for_input() const;
+	// The quirks every variant is usually run with
+	static int get_variant_quirks(Chip8Variant variant);
+	// The bytes of memory a variant addresses
+	static int get_variant_memory_size(Chip8Variant variant);
+	static const char* get_variant_name(Chip8Variant variant);
+	// Switch to a variant and its usual quirks. XO-CHIP addresses MAX_MEM_SIZE bytes of memory, the
+	// others MEM_SIZE, and memory is resized to that: switching to a smaller one drops the rest.
+	void set_variant(Chip8Variant variant);
+	Chip8Variant get_variant() const;
+	// Replace the quirks with a combination of CHIP8_QUIRK_* bits. Savestates keep both the variant
+	// and the quirks.
+	void set_quirks(int quirks);
+	int get_quirks() const;
+	// Make run stop before executing the instruction at addr
+	void set_breakpoint(int addr, bool enabled = true);
+	void clear_breakpoints();
 	// Decrement the clock registers. Should be called 60 times a second.
 	void step_clocks();
-	// Whether or not the screen needs to be redrawn because of the last step
+	// Whether or not the last step (or run) ended with a drawing instruction
 	bool is_screen_dirty() const;
-	// Whether or not the specified pixel in the screen is turned on
+	// Which rows of the screen changed since the last call to clear_dirty_rows, bit y is row y.
+	// Frontends can use this to only redraw the rows that changed.
+	uint64_t get_dirty_rows() const;
+	// Mark every row as presented
+	void clear_dirty_rows();
+	// Whether the program ended with EXIT
+	bool has_exited() const;
+	// The size of the screen in the current mode, 64x32 or 128x64
+	int get_screen_width() const;
+	int get_screen_height() const;
+	// Whether or not the specified pixel in the first plane is turned on
 	bool get_pixel_value(int x, int y) const;
+	// The first 64 pixels of a row of the first plane, the leftmost pixel is the most significant bit
+	uint64_t get_screen_row(int y) const;
+	// All the rows of a plane, get_screen_width() / 64 words per row in the same format
+	const uint64_t* get_screen_rows(int plane = 0) const;
+	// FNV-1a over the screen rows, continuing from hash so the screens of many frames can be chained
+	uint64_t get_screen_hash(uint64_t hash = 14695981039346656037ull) const;
+#ifdef CHIP8_PROFILE
+	// Counts since the interpreter was created or the profile was cleared. Loading a savestate doesn't
+	// change them.
+	const Chip8Profile& get_profile() const;
+	void clear_profile();
+#endif
 private:
-	void instr_0nnn(short instr);
-	void instr_00E0(short instr);
-	void instr_00EE(short instr);
-	void instr_1nnn(short instr);
-	void instr_2nnn(short instr);
-	void instr_3xkk(short instr);
-	void instr_4xkk(short instr);
-	void instr_5xy0(short instr);
-	void instr_6xkk(short instr);
-	void instr_7xkk(short instr);
-	void instr_8xy0(short instr);
-	void instr_8xy1(short instr);
-	void instr_8xy2(short instr);
-	void instr_8xy3(short instr);
-	void instr_8xy4(short instr);
-	void instr_8xy5(short instr);
-	void instr_8xy6(short instr);
-	void instr_8xy7(short instr);
-	void instr_8xyE(short instr);
-	void instr_9xy0(short instr);
-	void instr_Annn(short instr);
-	void instr_Bnnn(short instr);
-	void instr_Cxkk(short instr);
-	void instr_Dxyn(short instr);
-	void instr_Ex9E(short instr);
-	void instr_ExA1(short instr);
-	void instr_Fx07(short instr);
-	void instr_Fx0A(short instr);
-	void instr_Fx15(short instr);
-	void instr_Fx18(short instr);
-	void instr_Fx1E(short instr);
-	void instr_Fx29(short instr);
-	void instr_Fx33(short instr);
-	void instr_Fx55(short instr);
-	void instr_Fx65(short instr);
+	// Picks the run loop compiled for the current quirks
+	template <bool check_condition>
+	Chip8StopReason run_with_quirks(long long cycles, Chip8Condition condition, void* context);
+	template <bool check_condition, int quirk_set>
+	Chip8StopReason run_loop(long long cycles, Chip8Condition condition, void* context);
+	void raise_trap(Chip8Trap trap);
+	// Whether the loop starting at addr waits for the delay timer and can't end before it ticks
+	bool is_timer_wait_loop(int addr) const;
+
+	// Decode the instruction starting at the specified address
+	Chip8Instruction decode_at(int addr) const;
+	// Like decode_at, but fuses the instruction with the ones after it into a superinstruction if it can
+	Chip8Instruction decode_fused(int addr) const;
+	// Whether a superinstruction of that many instructions can run instead of only its first one
+	bool can_fuse(int length) const;
+	// Must be called after writing to memory, so modified code is decoded again
+	void invalidate_code(int addr, int size);
+
+	int get_words_per_row() const;
+	// Bits of dirty_rows for every row of the current mode
+	uint64_t get_all_rows() const;
+	// Draw a sprite of the specified width in bytes and height at Vx, Vy on every selected plane
+	template <int quirk_set, int words_per_row>
+	void draw_sprite(const Chip8Instruction& instr, int sprite_bytes_per_row, int height);
+#ifdef CHIP8_SPRITE_CACHE
+	// The rows of the low resolution sprite at addr, shifted (or rotated) right by x
+	template <int quirk_set>
+	const uint64_t* get_shifted_sprite(int addr, int height, int x);
+	void clear_sprite_cache();
+#endif
+	// Move the selected planes down by rows (up if negative), or right by pixels (left if negative)
+	void scroll_vertical(int rows);
+	void scroll_horizontal(int pixels);
+	// Switch the screen resolution, which clears every plane
+	void set_hires(bool enabled);
+
+	void instr_0nnn(const Chip8Instruction& instr);
+	void instr_00E0(const Chip8Instruction& instr);
+	void instr_00EE(const Chip8Instruction& instr);
+	void instr_00Cn(const Chip8Instruction& instr);
+	void instr_00Dn(const Chip8Instruction& instr);
+	void instr_00FB(const Chip8Instruction& instr);
+	void instr_00FC(const Chip8Instruction& instr);
+	void instr_00FD(const Chip8Instruction& instr);
+	void instr_00FE(const Chip8Instruction& instr);
+	void instr_00FF(const Chip8Instruction& instr);
+	void instr_1nnn(const Chip8Instruction& instr);
+	void instr_2nnn(const Chip8Instruction& instr);
+	void instr_3xkk(const Chip8Instruction& instr);
+	void instr_4xkk(const Chip8Instruction& instr);
+	void instr_5xy0(const Chip8Instruction& instr);
+	void instr_5xy2(const Chip8Instruction& instr);
+	void instr_5xy3(const Chip8Instruction& instr);
+	void instr_6xkk(const Chip8Instruction& instr);
+	void instr_7xkk(const Chip8Instruction& instr);
+	void instr_8xy0(const Chip8Instruction& instr);
+	void instr_8xy1(const Chip8Instruction& instr);
+	void instr_8xy2(const Chip8Instruction& instr);
+	void instr_8xy3(const Chip8Instruction& instr);
+	void instr_8xy4(const Chip8Instruction& instr);
+	void instr_8xy5(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_8xy6(const Chip8Instruction& instr);
+	void instr_8xy7(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_8xyE(const Chip8Instruction& instr);
+	void instr_9xy0(const Chip8Instruction& instr);
+	void instr_Annn(const Chip8Instruction& instr);
+	void instr_Bnnn(const Chip8Instruction& instr);
+	void instr_Cxkk(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_Dxyn(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_Dxy0(const Chip8Instruction& instr);
+	void instr_Ex9E(const Chip8Instruction& instr);
+	void instr_ExA1(const Chip8Instruction& instr);
+	void instr_F000(const Chip8Instruction& instr);
+	void instr_Fn01(const Chip8Instruction& instr);
+	void instr_F002(const Chip8Instruction& instr);
+	void instr_Fx07(const Chip8Instruction& instr);
+	void instr_Fx0A(const Chip8Instruction& instr);
+	void instr_Fx15(const Chip8Instruction& instr);
+	void instr_Fx18(const Chip8Instruction& instr);
+	void instr_Fx1E(const Chip8Instruction& instr);
+	void instr_Fx29(const Chip8Instruction& instr);
+	void instr_Fx30(const Chip8Instruction& instr);
+	void instr_Fx33(const Chip8Instruction& instr);
+	void instr_Fx3A(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_Fx55(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_Fx65(const Chip8Instruction& instr);
+	void instr_Fx75(const Chip8Instruction& instr);
+	void instr_Fx85(const Chip8Instruction& instr);
+	void instr_unknown_8xyn(const Chip8Instruction& instr);
+	void instr_unknown_Exkk(const Chip8Instruction& instr);
+	void instr_unknown_Fxkk(const Chip8Instruction& instr);
+
+	template <int quirk_set> void instr_6xkk_6xkk(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_Annn_Dxyn(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_7xkk_3xkk_1nnn(const Chip8Instruction& instr);
+	template <int quirk_set> void instr_Fx07_3xkk_1nnn(const Chip8Instruction& instr);
 };
@@ -0,0 +1,647 @@
+#include <cstring>
+
+#include "chip8_batch.h"
+
+#define STOP_FLAG_DRAWN 1
+#define STOP_FLAG_KEY_WAIT 2
+#define STOP_FLAG_TRAP 4
+
+Chip8Batch::Chip8Batch(const byte* rom, int rom_size, const std::vector<Chip8Host*>& hosts, uint64_t seed)
+	: lane_count((int)hosts.size()), hosts(hosts) {
+	if (rom_size > MEM_SIZE - 512) {
+		throw std::runtime_error("Rom is too large to fit in memory");
+	}
+	shared_memory.assign(MEM_SIZE, 0);
+	std::copy(Chip8::font, Chip8::font + FONT_SIZE, shared_memory.begin());
+	std::copy(Chip8::big_font, Chip8::big_font + BIG_FONT_SIZE, shared_memory.begin() + FONT_SIZE);
+	std::copy(rom, rom + rom_size, shared_memory.begin() + 512);
+	shared_decoded.assign(MEM_SIZE, Chip8Instruction());
+
+	lane_memory.assign(lane_count, shared_memory.data());
+	private_memory.resize(lane_count);
+
+	V_registers.assign(16 * lane_count, 0);
+	I_register.assign(lane_count, 0);
+	PC_register.assign(lane_count, 512);
+	SP_register.assign(lane_count, 0xFF); // The stack starts out empty
+	DT_register.assign(lane_count, 0);
+	ST_register.assign(lane_count, 0);
+	stack.assign(16 * lane_count, 0);
+
+	screen.assign(SCREEN_HEIGHT * lane_count, 0);
+	dirty_rows.assign(lane_count, 0);
+
+	blocking_for_key.assign(lane_count, false);
+	stop_flags.assign(lane_count, 0);
+	trap.assign(lane_count, TRAP_NONE);
+	cycle_count.assign(lane_count, 0);
+
+	random.resize(lane_count);
+	for (int lane = 0; lane < lane_count; lane++) {
+		random[lane].seed(seed + lane);
+	}
+}
+
+int Chip8Batch::get_lane_count() const {
+	return lane_count;
+}
+
+void Chip8Batch::set_quirks(int quirks) {
+	this->quirks = quirks & (CHIP8_QUIRK_SETS - 1);
+}
+
+int Chip8Batch::get_quirks() const {
+	return quirks;
+}
+
+void Chip8Batch::run(long long cycles) {
+	// Reset the stop state, appropriate instructions will set it.
+	std::fill(stop_flags.begin(), stop_flags.end(), 0);
+	std::fill(trap.begin(), trap.end(), TRAP_NONE);
+
+	const byte* shared = shared_memory.data();
+	for (long long cycle = 0; cycle < cycles; cycle++) {
+		bool any_running = false;
+		int lane = 0;
+		while (lane < lane_count) {
+			if (stop_flags[lane]) {
+				lane++;
+				continue;
+			}
+			any_running = true;
+
+			short pc = PC_register[lane];
+			if (pc + 1 >= MEM_SIZE) {
+				raise_trap(lane, TRAP_PC_OUT_OF_BOUNDS);
+				lane++;
+				continue;
+			}
+
+			// Neighbouring lanes that are about to execute the same instruction from the shared memory are
+			// executed together
+			int end = lane + 1;
+			Chip8Instruction instr;
+			if (lane_memory[lane] == shared) {
+				while (end < lane_count && !stop_flags[end] && PC_register[end] == pc && lane_memory[end] == shared) {
+					end++;
+				}
+				Chip8Instruction& cached = shared_decoded[pc];
+				if (cached.opcode == OP_NOT_DECODED) {
+					cached = Chip8::decode_at(shared, pc);
+				}
+				instr = cached;
+			} else {
+				// Lanes with private memory are rare, so their code isn't cached
+				instr = Chip8::decode_at(lane_memory[lane], pc);
+			}
+
+			int traps_before = trap_count;
+			execute(instr, lane, end);
+
+			if (trap_count == traps_before) {
+				for (int i = lane; i < end; i++) {
+					PC_register[i] += 2;
+					cycle_count[i]++;
+				}
+			} else {
+				for (int i = lane; i < end; i++) {
+					// A faulting instruction didn't execute, PC stays on it
+					if (!(stop_flags[i] & STOP_FLAG_TRAP)) {
+						PC_register[i] += 2;
+						cycle_count[i]++;
+					}
+				}
+			}
+			lane = end;
+		}
+
+		if (!any_running) {
+			break;
+		}
+	}
+}
+
+void Chip8Batch::execute(const Chip8Instruction& instr, int begin, int end) {
+	switch (instr.opcode) {
+#define CHIP8_HANDLER_CASE(name) case OP_##name: instr_##name(instr, begin, end); break;
+	CHIP8_BASE_INSTRUCTIONS(CHIP8_HANDLER_CASE)
+#undef CHIP8_HANDLER_CASE
+	default: break;
+	}
+}
+
+Chip8StopReason Chip8Batch::get_stop_reason(int lane) const {
+	if (stop_flags[lane] & STOP_FLAG_TRAP) {
+		return STOP_FAULT;
+	} else if (stop_flags[lane] & STOP_FLAG_DRAWN) {
+		return STOP_FRAME_DRAWN;
+	} else if (stop_flags[lane] & STOP_FLAG_KEY_WAIT) {
+		return STOP_KEY_WAIT;
+	}
+	return STOP_CYCLES;
+}
+
+Chip8Trap Chip8Batch::get_trap(int lane) const {
+	return trap[lane];
+}
+
+long long Chip8Batch::get_cycle_count(int lane) const {
+	return cycle_count[lane];
+}
+
+void Chip8Batch::step_clocks() {
+	for (int lane = 0; lane < lane_count; lane++) {
+		DT_register[lane] -= (DT_register[lane] > 0);
+		ST_register[lane] -= (ST_register[lane] > 0);
+	}
+}
+
+byte Chip8Batch::get_V_register(int lane, int reg) const {
+	return V_registers[reg * lane_count + lane];
+}
+
+unsigned short Chip8Batch::get_I_register(int lane) const {
+	return I_register[lane];
+}
+
+short Chip8Batch::get_PC_register(int lane) const {
+	return PC_register[lane];
+}
+
+bool Chip8Batch::is_memory_shared(int lane) const {
+	return lane_memory[lane] == shared_memory.data();
+}
+
+template <typename T>
+static size_t vector_bytes(const std::vector<T>& vector) {
+	return vector.capacity() * sizeof(T);
+}
+
+size_t Chip8Batch::get_memory_usage() const {
+	size_t usage = sizeof(Chip8Batch) + vector_bytes(shared_memory) + vector_bytes(shared_decoded)
+		+ vector_bytes(lane_memory) + vector_bytes(private_memory) + vector_bytes(V_registers)
+		+ vector_bytes(I_register) + vector_bytes(PC_register) + vector_bytes(SP_register) + vector_bytes(DT_register)
+		+ vector_bytes(ST_register) + vector_bytes(stack) + vector_bytes(screen) + vector_bytes(dirty_rows)
+		+ vector_bytes(blocking_for_key) + vector_bytes(stop_flags) + vector_bytes(trap) + vector_bytes(cycle_count)
+		+ vector_bytes(random) + vector_bytes(hosts);
+	for (const std::unique_ptr<byte[]>& memory : private_memory) {
+		if (memory) {
+			usage += MEM_SIZE;
+		}
+	}
+	return usage;
+}
+
+uint64_t Chip8Batch::get_dirty_rows(int lane) const {
+	return dirty_rows[lane];
+}
+
+void Chip8Batch::clear_dirty_rows(int lane) {
+	dirty_rows[lane] = 0;
+}
+
+bool Chip8Batch::get_pixel_value(int lane, int x, int y) const {
+	return (screen[y * lane_count + lane] >> (63 - x)) & 1;
+}
+
+uint64_t Chip8Batch::get_screen_row(int lane, int y) const {
+	return screen[y * lane_count + lane];
+}
+
+void Chip8Batch::raise_trap(int lane, Chip8Trap trap) {
+	this->trap[lane] = trap;
+	stop_flags[lane] |= STOP_FLAG_TRAP;
+	trap_count++;
+}
+
+byte* Chip8Batch::get_writable_memory(int lane) {
+	if (!private_memory[lane]) {
+		private_memory[lane].reset(new byte[MEM_SIZE]);
+		std::memcpy(private_memory[lane].get(), lane_memory[lane], MEM_SIZE);
+		lane_memory[lane] = private_memory[lane].get();
+	}
+	return lane_memory[lane];
+}
+
+/*
+Every handler executes the instruction on lanes [begin, end). The semantics are exactly the same as
+the Chip8 handlers, including the order in which VF and Vx are written when x is F.
+*/
+
+#define ADDR(instr) ((instr).nnn)
+#define X_REG(instr) ((instr).x)
+#define Y_REG(instr) ((instr).y)
+#define IMM_BYTE(instr) ((instr).kk)
+#define IMM_NIBBLE(instr) ((instr).n)
+// The specified register of every lane
+#define V(reg) (&V_registers[(reg) * lane_count])
+
+static inline uint64_t rotate_right(uint64_t value, int amount) {
+	return (value >> amount) | (value << ((64 - amount) & 63));
+}
+
+// SYS addr
+void Chip8Batch::instr_0nnn(const Chip8Instruction& instr, int begin, int end) {
+	// Instruction ignored.
+	for (int lane = begin; lane < end; lane++) {
+		std::cout << ("SYS instruction with address: " + std::to_string(ADDR(instr)) + "\n") << std::flush;
+	}
+}
+
+// CLS
+void Chip8Batch::instr_00E0(const Chip8Instruction& instr, int begin, int end) {
+	for (int y = 0; y < SCREEN_HEIGHT; y++) {
+		uint64_t* row = &screen[y * lane_count];
+		for (int lane = begin; lane < end; lane++) {
+			if (row[lane]) {
+				dirty_rows[lane] |= 1ull << y;
+			}
+			row[lane] = 0;
+		}
+	}
+	for (int lane = begin; lane < end; lane++) {
+		stop_flags[lane] |= STOP_FLAG_DRAWN;
+	}
+}
+
+// RET
+void Chip8Batch::instr_00EE(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		if (SP_register[lane] == 0xFF) {
+			raise_trap(lane, TRAP_STACK_UNDERFLOW);
+			continue;
+		}
+		PC_register[lane] = stack[SP_register[lane] * lane_count + lane];
+		SP_register[lane]--;
+	}
+}
+
+// JP addr
+void Chip8Batch::instr_1nnn(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		PC_register[lane] = ADDR(instr) - 2;
+	}
+}
+
+// CALL addr
+void Chip8Batch::instr_2nnn(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		if (SP_register[lane] == 15) {
+			raise_trap(lane, TRAP_STACK_OVERFLOW);
+			continue;
+		}
+		SP_register[lane]++;
+		stack[SP_register[lane] * lane_count + lane] = PC_register[lane];
+		PC_register[lane] = ADDR(instr) - 2;
+	}
+}
+
+// JP V0, addr
+void Chip8Batch::instr_Bnnn(const Chip8Instruction& instr, int begin, int end) {
+	byte* v0 = V(0);
+	for (int lane = begin; lane < end; lane++) {
+		PC_register[lane] = ADDR(instr) + v0[lane] - 2;
+	}
+}
+
+// SE Vx, byte
+void Chip8Batch::instr_3xkk(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		PC_register[lane] += (vx[lane] == IMM_BYTE(instr)) ? 2 : 0;
+	}
+}
+
+// SNE Vx, byte
+void Chip8Batch::instr_4xkk(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		PC_register[lane] += (vx[lane] != IMM_BYTE(instr)) ? 2 : 0;
+	}
+}
+
+// SE Vx, Vy
+void Chip8Batch::instr_5xy0(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		PC_register[lane] += (vx[lane] == vy[lane]) ? 2 : 0;
+	}
+}
+
+// LD Vx, byte
+void Chip8Batch::instr_6xkk(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		vx[lane] = IMM_BYTE(instr);
+	}
+}
+
+// ADD Vx, byte
+void Chip8Batch::instr_7xkk(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		vx[lane] += IMM_BYTE(instr);
+	}
+}
+
+// LD Vx, Vy
+void Chip8Batch::instr_8xy0(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		vx[lane] = vy[lane];
+	}
+}
+
+// OR Vx, Vy
+void Chip8Batch::instr_8xy1(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		vx[lane] |= vy[lane];
+	}
+}
+
+// AND Vx, Vy
+void Chip8Batch::instr_8xy2(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		vx[lane] &= vy[lane];
+	}
+}
+
+// XOR Vx, Vy
+void Chip8Batch::instr_8xy3(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		vx[lane] ^= vy[lane];
+	}
+}
+
+// ADD Vx, Vy
+void Chip8Batch::instr_8xy4(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	byte* vf = V(0xF);
+	for (int lane = begin; lane < end; lane++) {
+		int sum = vx[lane] + vy[lane];
+		vf[lane] = (sum > 255) ? 1 : 0; // Overflow
+		vx[lane] = sum & 0xFF;
+	}
+}
+
+// SUB Vx, Vy
+void Chip8Batch::instr_8xy5(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	byte* vf = V(0xF);
+	for (int lane = begin; lane < end; lane++) {
+		vf[lane] = (vx[lane] >= vy[lane]) ? 1 : 0;
+		vx[lane] -= vy[lane];
+	}
+}
+
+// SHR Vx {, Vy}
+void Chip8Batch::instr_8xy6(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* source = V((quirks & CHIP8_QUIRK_SHIFT_VY) ? Y_REG(instr) : X_REG(instr));
+	byte* vf = V(0xF);
+	for (int lane = begin; lane < end; lane++) {
+		vf[lane] = source[lane] & 1;
+		vx[lane] = source[lane] >> 1;
+	}
+}
+
+// SHL Vx {, Vy}
+void Chip8Batch::instr_8xyE(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* source = V((quirks & CHIP8_QUIRK_SHIFT_VY) ? Y_REG(instr) : X_REG(instr));
+	byte* vf = V(0xF);
+	for (int lane = begin; lane < end; lane++) {
+		vf[lane] = (source[lane] >> 7) & 1;
+		vx[lane] = source[lane] << 1;
+	}
+}
+
+// SUBN Vx, Vy
+void Chip8Batch::instr_8xy7(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	byte* vf = V(0xF);
+	for (int lane = begin; lane < end; lane++) {
+		vf[lane] = (vy[lane] >= vx[lane]) ? 1 : 0;
+		vx[lane] = vy[lane] - vx[lane];
+	}
+}
+
+// SNE Vx, Vy
+void Chip8Batch::instr_9xy0(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		PC_register[lane] += (vx[lane] != vy[lane]) ? 2 : 0;
+	}
+}
+
+// LD I, addr
+void Chip8Batch::instr_Annn(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		I_register[lane] = ADDR(instr);
+	}
+}
+
+// RND Vx, byte
+void Chip8Batch::instr_Cxkk(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		vx[lane] = (random[lane].next() >> 24) & IMM_BYTE(instr);
+	}
+}
+
+// DRW Vx, Vy, nibble
+void Chip8Batch::instr_Dxyn(const Chip8Instruction& instr, int begin, int end) {
+	bool clip = quirks & CHIP8_QUIRK_CLIP_SPRITES;
+	byte* vx = V(X_REG(instr));
+	byte* vy = V(Y_REG(instr));
+	byte* vf = V(0xF);
+	for (int lane = begin; lane < end; lane++) {
+		if (I_register[lane] + IMM_NIBBLE(instr) > MEM_SIZE) {
+			raise_trap(lane, TRAP_DRAW_OUT_OF_BOUNDS);
+			continue;
+		}
+
+		const byte* sprite = lane_memory[lane] + I_register[lane];
+		int base_x = vx[lane] % SCREEN_WIDTH;
+		int base_y = vy[lane] % SCREEN_HEIGHT;
+		int height = clip ? std::min((int)IMM_NIBBLE(instr), SCREEN_HEIGHT - base_y) : IMM_NIBBLE(instr);
+		uint64_t collision = 0;
+		for (int y = 0; y < height; y++) {
+			uint64_t sprite_row = clip ? ((uint64_t)sprite[y] << 56) >> base_x
+				: rotate_right((uint64_t)sprite[y] << 56, base_x);
+			int pos_y = (base_y + y) % SCREEN_HEIGHT;
+			uint64_t& screen_row = screen[pos_y * lane_count + lane];
+			collision |= screen_row & sprite_row;
+			screen_row ^= sprite_row;
+			if (sprite_row) {
+				dirty_rows[lane] |= 1ull << pos_y;
+			}
+		}
+		vf[lane] = collision ? 1 : 0;
+
+		stop_flags[lane] |= STOP_FLAG_DRAWN;
+	}
+}
+
+// SKP Vx
+void Chip8Batch::instr_Ex9E(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		if (hosts[lane]->is_key_down(vx[lane] & 0xF)) {
+			PC_register[lane] += 2;
+		}
+	}
+}
+
+// SKNP Vx
+void Chip8Batch::instr_ExA1(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		if (!hosts[lane]->is_key_down(vx[lane] & 0xF)) {
+			PC_register[lane] += 2;
+		}
+	}
+}
+
+// LD Vx, DT
+void Chip8Batch::instr_Fx07(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		vx[lane] = DT_register[lane];
+	}
+}
+
+// LD Vx, K
+void Chip8Batch::instr_Fx0A(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		if (blocking_for_key[lane]) {
+			int key_number = hosts[lane]->get_capture_key();
+			if (key_number != -1) {
+				vx[lane] = key_number;
+				blocking_for_key[lane] = false;
+				continue;
+			}
+		} else {
+			blocking_for_key[lane] = true;
+			hosts[lane]->enable_key_capture();
+		}
+		// We block by executing this instruction repeatedly until we capture a key press
+		PC_register[lane] -= 2;
+		stop_flags[lane] |= STOP_FLAG_KEY_WAIT;
+	}
+}
+
+// LD DT, Vx
+void Chip8Batch::instr_Fx15(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		DT_register[lane] = vx[lane];
+	}
+}
+
+// LD ST, Vx
+void Chip8Batch::instr_Fx18(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		ST_register[lane] = vx[lane];
+	}
+}
+
+// ADD I, Vx
+void Chip8Batch::instr_Fx1E(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		I_register[lane] += vx[lane];
+	}
+}
+
+// LD F, Vx
+void Chip8Batch::instr_Fx29(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		I_register[lane] = 5 * vx[lane];
+	}
+}
+
+// LD B, Vx
+void Chip8Batch::instr_Fx33(const Chip8Instruction& instr, int begin, int end) {
+	byte* vx = V(X_REG(instr));
+	for (int lane = begin; lane < end; lane++) {
+		int addr = I_register[lane];
+		if (addr + 2 >= MEM_SIZE) {
+			raise_trap(lane, TRAP_STORE_BCD_OUT_OF_BOUNDS);
+			continue;
+		}
+		byte* memory = get_writable_memory(lane);
+		memory[addr] = vx[lane] / 100;
+		memory[addr + 1] = (vx[lane] / 10) % 10;
+		memory[addr + 2] = vx[lane] % 10;
+	}
+}
+
+// LD [I], Vx
+void Chip8Batch::instr_Fx55(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		int addr = I_register[lane];
+		if (addr + X_REG(instr) >= MEM_SIZE) {
+			raise_trap(lane, TRAP_STORE_REGISTERS_OUT_OF_BOUNDS);
+			continue;
+		}
+		byte* memory = get_writable_memory(lane);
+		for (int i = 0; i <= X_REG(instr); i++) {
+			memory[addr + i] = V(i)[lane];
+		}
+		if (quirks & CHIP8_QUIRK_LOAD_STORE_I) {
+			I_register[lane] += X_REG(instr) + 1;
+		}
+	}
+}
+
+// LD Vx, [I]
+void Chip8Batch::instr_Fx65(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		int addr = I_register[lane];
+		if (addr + X_REG(instr) >= MEM_SIZE) {
+			raise_trap(lane, TRAP_LOAD_REGISTERS_OUT_OF_BOUNDS);
+			continue;
+		}
+		const byte* memory = lane_memory[lane];
+		for (int i = 0; i <= X_REG(instr); i++) {
+			V(i)[lane] = memory[addr + i];
+		}
+		if (quirks & CHIP8_QUIRK_LOAD_STORE_I) {
+			I_register[lane] += X_REG(instr) + 1;
+		}
+	}
+}
+
+void Chip8Batch::instr_unknown_8xyn(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		raise_trap(lane, TRAP_UNKNOWN_8xyn);
+	}
+}
+
+void Chip8Batch::instr_unknown_Exkk(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		raise_trap(lane, TRAP_UNKNOWN_Exkk);
+	}
+}
+
+void Chip8Batch::instr_unknown_Fxkk(const Chip8Instruction& instr, int begin, int end) {
+	for (int lane = begin; lane < end; lane++) {
+		raise_trap(lane, TRAP_UNKNOWN_Fxkk);
+	}
+}
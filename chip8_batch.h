@@ -0,0 +1,101 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "chip8.h"
+
+/*
+Runs many independent CHIP-8 machines ("lanes") of the same rom together.
+
+The machine state is stored as a structure of arrays: register r of every lane is contiguous
+(V_registers[r * lane_count + lane]), as are PC, I, the timers and every screen row. Each step
+the lanes are split into runs of neighbouring lanes that are about to execute the same
+instruction, and every handler loops over such a run, so while the lanes agree (same rom, same
+input) register instructions are executed for all of them by vectorized loops. Lanes that
+diverged are executed one at a time by the same handlers.
+
+All lanes read the same copy of the rom and font, with its instructions decoded once, until a
+lane writes to memory (Fx33, Fx55). That lane then gets a private copy of memory.
+
+Only the CHIP-8 instruction set is supported, without the SUPER-CHIP and XO-CHIP extensions.
+*/
+class Chip8Batch {
+	int lane_count;
+
+	// Memory image shared by the lanes that never wrote to memory, and its decoded instructions
+	std::vector<byte> shared_memory;
+	std::vector<Chip8Instruction> shared_decoded;
+	// The memory every lane reads, either shared_memory or the lane's private copy
+	std::vector<byte*> lane_memory;
+	std::vector<std::unique_ptr<byte[]>> private_memory;
+
+	std::vector<byte> V_registers;
+	std::vector<unsigned short> I_register;
+	std::vector<short> PC_register;
+	std::vector<byte> SP_register;
+	std::vector<byte> DT_register;
+	std::vector<byte> ST_register;
+	// stack[level * lane_count + lane]
+	std::vector<short> stack;
+
+	// screen[y * lane_count + lane], in the same format as Chip8
+	std::vector<uint64_t> screen;
+	std::vector<uint64_t> dirty_rows;
+
+	std::vector<byte> blocking_for_key;
+	// Lanes with stop flags set don't execute anything else in the current run
+	std::vector<byte> stop_flags;
+	std::vector<Chip8Trap> trap;
+	// Faults raised so far, so lanes that didn't fault can be advanced without checking each one
+	int trap_count = 0;
+	std::vector<long long> cycle_count;
+
+	std::vector<Xoshiro128> random;
+
+	std::vector<Chip8Host*> hosts;
+	// CHIP8_QUIRK_* bits, the same for every lane
+	int quirks = 0;
+public:
+	// Create one lane per host, all running the specified rom. The hosts must outlive the batch. Lane
+	// i generates the same random numbers as a Chip8 created with seed + i.
+	Chip8Batch(const byte* rom, int rom_size, const std::vector<Chip8Host*>& hosts, uint64_t seed = 0);
+
+	int get_lane_count() const;
+	// Like Chip8::set_quirks, for every lane. The handlers check the quirks once per run of lanes, not per lane.
+	void set_quirks(int quirks);
+	int get_quirks() const;
+
+	// Execute up to the specified number of instructions on every lane. Like Chip8::run, a lane stops
+	// early when it draws, waits for a key or faults.
+	void run(long long cycles);
+	// Why the lane stopped in the last run
+	Chip8StopReason get_stop_reason(int lane) const;
+	Chip8Trap get_trap(int lane) const;
+	long long get_cycle_count(int lane) const;
+	// Decrement the clock registers of every lane. Should be called 60 times a second.
+	void step_clocks();
+
+	byte get_V_register(int lane, int reg) const;
+	unsigned short get_I_register(int lane) const;
+	short get_PC_register(int lane) const;
+	// Whether the lane still reads the shared memory image
+	bool is_memory_shared(int lane) const;
+	// How many bytes of memory the batch uses, to compare with sizeof(Chip8) per machine
+	size_t get_memory_usage() const;
+
+	uint64_t get_dirty_rows(int lane) const;
+	void clear_dirty_rows(int lane);
+	bool get_pixel_value(int lane, int x, int y) const;
+	uint64_t get_screen_row(int lane, int y) const;
+private:
+	// Execute an instruction on lanes [begin, end), which all have the same PC and memory
+	void execute(const Chip8Instruction& instr, int begin, int end);
+	void raise_trap(int lane, Chip8Trap trap);
+	// Give the lane a private copy of memory before it writes to it
+	byte* get_writable_memory(int lane);
+
+#define CHIP8_BATCH_HANDLER(name) void instr_##name(const Chip8Instruction& instr, int begin, int end);
+	CHIP8_BASE_INSTRUCTIONS(CHIP8_BATCH_HANDLER)
+#undef CHIP8_BATCH_HANDLER
+};
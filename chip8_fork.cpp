@@ -0,0 +1,72 @@
+#include "chip8_fork.h"
+
+// Savestates are put together here instead of on the stack, where an XO-CHIP one would take 66KB.
+// Forks are captured and restored by many threads at once, so every thread has its own.
+static thread_local std::vector<byte> scratch;
+
+Chip8Fork::Chip8Fork(const Chip8& emu) {
+	capture(emu, nullptr);
+}
+
+Chip8Fork::Chip8Fork(const Chip8& emu, const Chip8Fork& parent) {
+	capture(emu, parent.is_empty() ? nullptr : &parent);
+}
+
+void Chip8Fork::capture(const Chip8& emu, const Chip8Fork* parent) {
+	// Padded to whole chunks, the padding is always zero
+	size_t chunk_count = (emu.get_savestate_size() + FORK_CHUNK_SIZE - 1) / FORK_CHUNK_SIZE;
+	if (scratch.size() < chunk_count * FORK_CHUNK_SIZE) {
+		scratch.resize(chunk_count * FORK_CHUNK_SIZE);
+	}
+	byte* state = scratch.data();
+	savestate_size = emu.save_state(state, scratch.size());
+	std::memset(state + savestate_size, 0, chunk_count * FORK_CHUNK_SIZE - savestate_size);
+	if (parent && parent->savestate_size != savestate_size) {
+		parent = nullptr;
+	}
+
+	chunks.resize(chunk_count);
+	for (size_t i = 0; i < chunk_count; i++) {
+		const byte* data = state + i * FORK_CHUNK_SIZE;
+		if (parent && std::memcmp(parent->chunks[i]->data, data, FORK_CHUNK_SIZE) == 0) {
+			chunks[i] = parent->chunks[i];
+		} else {
+			std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+			std::memcpy(chunk->data, data, FORK_CHUNK_SIZE);
+			chunks[i] = chunk;
+			private_bytes += sizeof(Chunk);
+		}
+	}
+}
+
+void Chip8Fork::restore(Chip8& emu) const {
+	if (scratch.size() < savestate_size) {
+		scratch.resize(savestate_size);
+	}
+	copy_savestate(scratch.data());
+	emu.load_state(scratch.data(), savestate_size);
+}
+
+size_t Chip8Fork::get_savestate(Chip8Savestate& savestate) const {
+	copy_savestate((byte*)&savestate);
+	return savestate_size;
+}
+
+void Chip8Fork::copy_savestate(byte* out) const {
+	if (is_empty()) {
+		throw std::runtime_error("Restoring an empty fork");
+	}
+	const size_t last = chunks.size() - 1;
+	for (size_t i = 0; i < last; i++) {
+		std::memcpy(out + i * FORK_CHUNK_SIZE, chunks[i]->data, FORK_CHUNK_SIZE);
+	}
+	std::memcpy(out + last * FORK_CHUNK_SIZE, chunks[last]->data, savestate_size - last * FORK_CHUNK_SIZE);
+}
+
+bool Chip8Fork::is_empty() const {
+	return chunks.empty();
+}
+
+size_t Chip8Fork::get_private_bytes() const {
+	return chunks.capacity() * sizeof(chunks[0]) + private_bytes;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "chip8.h"
+
+// Forks share their state in chunks of this many bytes, so a fork only costs the chunks it changed
+#define FORK_CHUNK_SIZE 256
+
+/*
+A snapshot of a machine for tree searches, which keep thousands of related states around.
+
+The savestate is split into chunks that are never modified once created, and shared between all
+the forks that have the same contents there. Copying a fork only copies the chunk pointers, and
+capturing a machine relative to a parent fork allocates only the chunks that differ from the
+parent, which for a frame of a typical game are a page or two of memory, the screen and the
+registers. Forks are run by restoring them into a machine, which only decodes the memory that
+changed since its last state. Chunks are immutable, so forks can be shared between threads.
+*/
+class Chip8Fork {
+	struct Chunk {
+		byte data[FORK_CHUNK_SIZE];
+	};
+
+	// As many as the savestate of the machine's variant needs
+	std::vector<std::shared_ptr<const Chunk>> chunks;
+	size_t savestate_size = 0;
+	// Bytes of the chunks created when the state was captured, instead of shared with the parent
+	size_t private_bytes = 0;
+public:
+	Chip8Fork() {}
+	// Capture the state of a machine
+	explicit Chip8Fork(const Chip8& emu);
+	// Capture the state of a machine that ran from parent, sharing the chunks that didn't change
+	Chip8Fork(const Chip8& emu, const Chip8Fork& parent);
+
+	// Replace the state of a machine with this fork's. The whole screen is marked dirty.
+	void restore(Chip8& emu) const;
+	// Like Chip8::save_state, returns the size of the savestate
+	size_t get_savestate(Chip8Savestate& savestate) const;
+
+	bool is_empty() const;
+	// Heap bytes only this fork holds: its chunk pointers and the chunks it doesn't share with the parent
+	size_t get_private_bytes() const;
+private:
+	void capture(const Chip8& emu, const Chip8Fork* parent);
+	// Write the savestate_size bytes of the savestate to out
+	void copy_savestate(byte* out) const;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+
+class Chip8;
+typedef unsigned char byte;
+
+/*
+Everything the interpreter needs from the platform it runs on. The core only
+talks to the outside world through this interface, so the same Chip8 class can
+run inside a Windows window or headless on a server.
+*/
+class Chip8Host {
+public:
+	virtual ~Chip8Host() {}
+
+	// Whether or not the specified key (0x0-0xF) is currently held down
+	virtual bool is_key_down(int key_number) = 0;
+	// Start listening for the next key press, used by LD Vx, K
+	virtual void enable_key_capture() = 0;
+	// Returns the captured key number, or -1 if not captured yet
+	virtual int get_capture_key() = 0;
+
+	// Handle pending platform events. Returns false once the host wants to stop.
+	virtual bool process_events() = 0;
+	// Show the current contents of the interpreter screen. Only the rows in emu.get_dirty_rows()
+	// changed since the last call.
+	virtual void present(const Chip8& emu) = 0;
+	// Returns once the specified time was reached, used to pace emulation to wall time
+	virtual void wait_until(std::chrono::steady_clock::time_point deadline) = 0;
+	// Like wait_until, but returns early when input arrives. Used while the interpreter can't do
+	// anything until a key is pressed. Hosts without asynchronous input just wait.
+	virtual void wait_for_input(std::chrono::steady_clock::time_point deadline) { wait_until(deadline); }
+	// Whether the user is holding the rewind control, so the frontend plays frames backwards
+	virtual bool is_rewinding() { return false; }
+	// Called after an instruction set the sound timer, the audio pattern or the pitch, so the sound
+	// can change at that cycle instead of at the end of the frame. step_clocks doesn't call it.
+	virtual void sound_changed(const Chip8& emu) {}
+};
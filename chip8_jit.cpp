@@ -0,0 +1,444 @@
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "chip8_jit.h"
+
+#if CHIP8_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+// x86-64 register numbers used by the generated code. The block arguments are in rdi (V registers),
+// rsi (I), rdx (DT) and ecx (instructions to execute), and only caller-saved scratch registers are used.
+#define REG_EAX 0
+#define REG_R8D 8
+#define REG_R9D 9
+#define REG_R10D 10
+
+// Opcodes of "op r/m32, r32"
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+
+// Most bytes a single instruction compiles to (8xy5 and 8xy7 take 38), the budget check in front of
+// it, and the return that ends a block which doesn't end with a jump or a skip
+#define JIT_MAX_INSTRUCTION_BYTES 40
+#define JIT_BUDGET_CHECK_BYTES 11
+#define JIT_BLOCK_EPILOGUE_BYTES 6
+
+Chip8Jit::Chip8Jit(Chip8& emu, bool lockstep) : emu(emu), memory_generation(emu.memory_generation) {
+	std::fill(block_at, block_at + MEM_SIZE, BLOCK_NOT_COMPILED);
+	if (lockstep) {
+		shadow = new Chip8(emu);
+	}
+
+#if CHIP8_JIT_SUPPORTED
+	void* memory = mmap(nullptr, JIT_CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory != MAP_FAILED) {
+		code_buffer = (byte*)memory;
+	}
+	// If we can't get executable memory we just keep interpreting.
+#endif
+}
+
+Chip8Jit::~Chip8Jit() {
+#if CHIP8_JIT_SUPPORTED
+	if (code_buffer) {
+		munmap(code_buffer, JIT_CODE_BUFFER_SIZE);
+	}
+#endif
+	delete shadow;
+}
+
+Chip8StopReason Chip8Jit::run(long long cycles) {
+	if (emu.memory_generation != memory_generation) {
+		// A savestate replaced all of memory, or the quirks the blocks were compiled for changed
+		flush();
+		std::fill(write_count, write_count + MEM_SIZE, 0);
+		memory_generation = emu.memory_generation;
+	}
+
+	Chip8StopReason reason = STOP_CYCLES;
+	long long start_cycle = emu.cycle_count;
+	long long end_cycle = emu.cycle_count + cycles;
+	while (emu.cycle_count < end_cycle) {
+		int pc = emu.PC_register;
+		short index = BLOCK_NOT_COMPILABLE;
+		if (code_buffer && pc >= 0 && pc + 1 < MEM_SIZE) {
+			index = block_at[pc];
+			if (index == BLOCK_NOT_COMPILED) {
+				index = compile(pc);
+			}
+		}
+
+		if ((index < 0 || blocks[index].jumps_back) && is_idle_jump(pc)) {
+			// Nothing in the loop writes memory, so the interpreter can take the rest of the budget
+			reason = emu.run(end_cycle - emu.cycle_count);
+			break;
+		}
+		if (index >= 0) {
+			run_block(blocks[index], (int)std::min(end_cycle - emu.cycle_count, (long long)JIT_MAX_BLOCK_INSTRUCTIONS));
+		} else {
+			reason = interpret();
+			if (reason != STOP_CYCLES) {
+				break;
+			}
+		}
+	}
+
+	if (shadow && emu.cycle_count - start_cycle > cycles) {
+		throw std::runtime_error("JIT lockstep mismatch: executed " + std::to_string(emu.cycle_count - start_cycle)
+			+ " instructions of a budget of " + std::to_string(cycles));
+	}
+	return reason;
+}
+
+Chip8StopReason Chip8Jit::interpret() {
+	// Remember what the instruction is about to write, so we can throw away the code it overwrites
+	int write_addr = emu.I_register;
+	int write_size = 0;
+	int pc = emu.PC_register;
+	if (pc + 1 < emu.memory_size) {
+		Chip8Instruction instr = emu.decode_at(pc);
+		if (instr.opcode == OP_Fx33) {
+			write_size = 3;
+		} else if (instr.opcode == OP_Fx55) {
+			write_size = instr.x + 1;
+		} else if (instr.opcode == OP_5xy2) {
+			write_size = std::abs(instr.x - instr.y) + 1;
+		}
+	}
+
+	Chip8StopReason reason = emu.run(1);
+
+	if (write_size && reason != STOP_FAULT) {
+		invalidate(write_addr, write_size);
+	}
+	// A timer wait loop can't skip anything with a budget of 1
+	return (reason == STOP_IDLE) ? STOP_CYCLES : reason;
+}
+
+bool Chip8Jit::is_idle_jump(int pc) const {
+	// With breakpoints the interpreter runs every iteration, and could run into writes we don't see
+	return !emu.breakpoint_count && pc >= 4 && emu.is_timer_wait_loop(pc - 4);
+}
+
+int Chip8Jit::run_block(const Block& block, int max_cycles) {
+	// The interpreter we check against starts from the same state
+	if (shadow) {
+		*shadow = emu;
+	}
+
+	// Blocks never draw, wait or fault
+	int instruction_count = std::min(block.instruction_count, max_cycles);
+	emu.stop_flags = 0;
+	emu.cycle_count += instruction_count;
+
+	BlockFunction function = (BlockFunction)block.code;
+	emu.PC_register = function(emu.V_registers, &emu.I_register, &emu.DT_register, instruction_count);
+
+	if (shadow) {
+		check_lockstep(block, instruction_count);
+	}
+	return instruction_count;
+}
+
+void Chip8Jit::check_lockstep(const Block& block, int instruction_count) {
+	for (int i = 0; i < instruction_count; i++) {
+		shadow->step();
+	}
+
+	if (memcmp(shadow->V_registers, emu.V_registers, sizeof(emu.V_registers)) != 0
+		|| shadow->I_register != emu.I_register || shadow->PC_register != emu.PC_register
+		|| shadow->SP_register != emu.SP_register || shadow->DT_register != emu.DT_register
+		|| shadow->ST_register != emu.ST_register) {
+		throw std::runtime_error("JIT lockstep mismatch in block at " + std::to_string(block.start));
+	}
+}
+
+bool Chip8Jit::is_compilable(int addr) const {
+	if (addr < 0 || addr + 1 >= MEM_SIZE) {
+		return false;
+	}
+	if (write_count[addr] >= JIT_SELF_MODIFYING_WRITES || write_count[addr + 1] >= JIT_SELF_MODIFYING_WRITES) {
+		return false;
+	}
+
+	Chip8Instruction instr = emu.decode_at(addr);
+	switch (instr.opcode) {
+	case OP_3xkk: case OP_4xkk: case OP_5xy0: case OP_9xy0:
+		// Compiled skips always skip 2 bytes
+		return instr.skip == 2;
+	case OP_1nnn: case OP_6xkk: case OP_7xkk:
+	case OP_8xy0: case OP_8xy1: case OP_8xy2: case OP_8xy3: case OP_8xy4: case OP_8xy5:
+	case OP_8xy6: case OP_8xy7: case OP_8xyE: case OP_Annn:
+	case OP_Fx07: case OP_Fx15: case OP_Fx1E: case OP_Fx29:
+		return true;
+	default:
+		return false;
+	}
+}
+
+short Chip8Jit::compile(int start) {
+	if (!is_compilable(start)) {
+		block_at[start] = BLOCK_NOT_COMPILABLE;
+		return BLOCK_NOT_COMPILABLE;
+	}
+
+	// Blocks end early when the buffer runs out, but there has to be room for at least one instruction
+	if (!has_room_for_instruction() || blocks.size() >= 0x7FFF) {
+		flush();
+	}
+
+	Block block;
+	block.start = start;
+	block.code = code_buffer + code_size;
+	block.instruction_count = 0;
+	block.valid = true;
+	Chip8Instruction first = emu.decode_at(start);
+	block.jumps_back = first.opcode == OP_1nnn && first.nnn == start - 4;
+
+	int pc = start;
+	bool ended = false;
+	bool ended_with_skip = false;
+	while (!ended && block.instruction_count < JIT_MAX_BLOCK_INSTRUCTIONS && has_room_for_instruction()
+		&& is_compilable(pc)) {
+		Chip8Instruction instr = emu.decode_at(pc);
+		int x = instr.x;
+		int y = instr.y;
+		if (block.instruction_count > 0) {
+			emit_budget_check(block.instruction_count, pc);
+		}
+		block.instruction_count++;
+
+		// Each instruction is translated literally, re-reading registers after VF is written,
+		// so the results match the interpreter even when x or y is 0xF.
+		switch (instr.opcode) {
+		case OP_1nnn: {
+			emit_return(instr.nnn);
+			ended = true;
+		} break;
+		case OP_3xkk:
+		case OP_4xkk:
+		case OP_5xy0:
+		case OP_9xy0: {
+			emit_skip(instr, pc);
+			ended = true;
+			ended_with_skip = true;
+		} break;
+		case OP_6xkk: {
+			emit({ 0xC6, 0x47, (byte)x, instr.kk }); // mov byte [rdi+x], kk
+		} break;
+		case OP_7xkk: {
+			emit({ 0x80, 0x47, (byte)x, instr.kk }); // add byte [rdi+x], kk
+		} break;
+		case OP_8xy0: {
+			emit_load_v(REG_EAX, y);
+			emit_store_v(x, REG_EAX);
+		} break;
+		case OP_8xy1:
+		case OP_8xy2:
+		case OP_8xy3: {
+			byte alu = (instr.opcode == OP_8xy1) ? ALU_OR : (instr.opcode == OP_8xy2) ? ALU_AND : ALU_XOR;
+			emit_load_v(REG_EAX, x);
+			emit_load_v(REG_R8D, y);
+			emit_alu(alu, REG_EAX, REG_R8D);
+			emit_store_v(x, REG_EAX);
+		} break;
+		case OP_8xy4: {
+			emit_load_v(REG_EAX, x);
+			emit_load_v(REG_R8D, y);
+			emit_alu(ALU_ADD, REG_EAX, REG_R8D);
+			emit({ 0x41, 0x89, 0xC1 }); // mov r9d, eax
+			emit({ 0x41, 0xC1, 0xE9, 0x08 }); // shr r9d, 8
+			emit_store_v(0xF, REG_R9D);
+			emit_store_v(x, REG_EAX);
+		} break;
+		case OP_8xy5:
+		case OP_8xy7: {
+			// 8xy5 is Vx - Vy, 8xy7 is Vy - Vx
+			int minuend = (instr.opcode == OP_8xy5) ? x : y;
+			int subtrahend = (instr.opcode == OP_8xy5) ? y : x;
+			emit_alu(ALU_XOR, REG_R9D, REG_R9D);
+			emit_load_v(REG_EAX, minuend);
+			emit_load_v(REG_R8D, subtrahend);
+			emit_alu(ALU_CMP, REG_EAX, REG_R8D);
+			emit({ 0x41, 0x0F, 0x93, 0xC1 }); // setae r9b
+			emit_store_v(0xF, REG_R9D);
+			emit_load_v(REG_EAX, minuend);
+			emit_load_v(REG_R8D, subtrahend);
+			emit_alu(ALU_SUB, REG_EAX, REG_R8D);
+			emit_store_v(x, REG_EAX);
+		} break;
+		case OP_8xy6: {
+			// The quirks can't change without flushing the blocks, see step
+			int source = (emu.quirks & CHIP8_QUIRK_SHIFT_VY) ? y : x;
+			emit_load_v(REG_EAX, source);
+			emit({ 0x83, 0xE0, 0x01 }); // and eax, 1
+			emit_store_v(0xF, REG_EAX);
+			emit_load_v(REG_EAX, source);
+			emit({ 0xD1, 0xE8 }); // shr eax, 1
+			emit_store_v(x, REG_EAX);
+		} break;
+		case OP_8xyE: {
+			int source = (emu.quirks & CHIP8_QUIRK_SHIFT_VY) ? y : x;
+			emit_load_v(REG_EAX, source);
+			emit({ 0xC1, 0xE8, 0x07 }); // shr eax, 7
+			emit({ 0x83, 0xE0, 0x01 }); // and eax, 1
+			emit_store_v(0xF, REG_EAX);
+			emit_load_v(REG_EAX, source);
+			emit({ 0xD1, 0xE0 }); // shl eax, 1
+			emit_store_v(x, REG_EAX);
+		} break;
+		case OP_Annn: {
+			emit({ 0x66, 0xC7, 0x06, (byte)(instr.nnn & 0xFF), (byte)(instr.nnn >> 8) }); // mov word [rsi], nnn
+		} break;
+		case OP_Fx07: {
+			emit({ 0x0F, 0xB6, 0x02 }); // movzx eax, byte [rdx]
+			emit_store_v(x, REG_EAX);
+		} break;
+		case OP_Fx15: {
+			emit_load_v(REG_EAX, x);
+			emit({ 0x88, 0x02 }); // mov [rdx], al
+		} break;
+		case OP_Fx1E: {
+			emit_load_v(REG_EAX, x);
+			emit({ 0x66, 0x01, 0x06 }); // add [rsi], ax
+		} break;
+		case OP_Fx29: {
+			emit_load_v(REG_EAX, x);
+			emit({ 0x8D, 0x04, 0x80 }); // lea eax, [rax+rax*4]
+			emit({ 0x66, 0x89, 0x06 }); // mov [rsi], ax
+		} break;
+		default:
+			break;
+		}
+
+		pc += 2;
+	}
+
+	if (!ended) {
+		emit_return(pc);
+	}
+	block.end = pc;
+	// Whether a skip skips 2 or 4 bytes depends on the instruction it skips (XO-CHIP's F000 nnnn), so
+	// writing that instruction has to throw the block away as well
+	if (ended_with_skip) {
+		block.end += 2;
+	}
+
+	blocks.push_back(block);
+	block_at[start] = (short)(blocks.size() - 1);
+	return block_at[start];
+}
+
+bool Chip8Jit::has_room_for_instruction() const {
+	return code_size + JIT_BUDGET_CHECK_BYTES + JIT_MAX_INSTRUCTION_BYTES + JIT_BLOCK_EPILOGUE_BYTES <= JIT_CODE_BUFFER_SIZE;
+}
+
+void Chip8Jit::invalidate(int addr, int size) {
+	int end = std::min(addr + size, MEM_SIZE);
+	for (int i = addr; i < end; i++) {
+		if (write_count[i] < 0xFF) {
+			write_count[i]++;
+		}
+	}
+
+	// Addresses that were not compilable may hold compilable code now, including skips over an
+	// F000 nnnn that was overwritten
+	for (int i = std::max(addr - 3, 0); i < end; i++) {
+		if (block_at[i] == BLOCK_NOT_COMPILABLE) {
+			block_at[i] = BLOCK_NOT_COMPILED;
+		}
+	}
+
+	for (Block& block : blocks) {
+		if (block.valid && block.start < end && block.end > addr) {
+			block.valid = false;
+			block_at[block.start] = BLOCK_NOT_COMPILED;
+		}
+	}
+}
+
+void Chip8Jit::flush() {
+	blocks.clear();
+	code_size = 0;
+	std::fill(block_at, block_at + MEM_SIZE, BLOCK_NOT_COMPILED);
+}
+
+void Chip8Jit::emit(std::initializer_list<byte> bytes) {
+	for (byte b : bytes) {
+		code_buffer[code_size++] = b;
+	}
+}
+
+void Chip8Jit::emit_imm32(int value) {
+	emit({ (byte)value, (byte)(value >> 8), (byte)(value >> 16), (byte)(value >> 24) });
+}
+
+// movzx reg, byte [rdi+v]
+void Chip8Jit::emit_load_v(int reg, int v) {
+	if (reg >= 8) {
+		emit({ 0x44 });
+	}
+	emit({ 0x0F, 0xB6, (byte)(0x47 | ((reg & 7) << 3)), (byte)v });
+}
+
+// mov byte [rdi+v], reg
+void Chip8Jit::emit_store_v(int v, int reg) {
+	if (reg >= 8) {
+		emit({ 0x44 });
+	}
+	emit({ 0x88, (byte)(0x47 | ((reg & 7) << 3)), (byte)v });
+}
+
+// op dst_reg, src_reg
+void Chip8Jit::emit_alu(byte opcode, int dst_reg, int src_reg) {
+	byte rex = 0x40 | ((src_reg >= 8) ? 0x04 : 0) | ((dst_reg >= 8) ? 0x01 : 0);
+	if (rex != 0x40) {
+		emit({ rex });
+	}
+	emit({ opcode, (byte)(0xC0 | ((src_reg & 7) << 3) | (dst_reg & 7)) });
+}
+
+// mov eax, pc; ret
+void Chip8Jit::emit_return(int pc) {
+	emit({ 0xB8 });
+	emit_imm32(pc);
+	emit({ 0xC3 });
+}
+
+// Returns pc if the block was entered with a budget of executed instructions, which are done by
+// now. Budgets are at most JIT_MAX_BLOCK_INSTRUCTIONS, so they fit the 8-bit immediate.
+void Chip8Jit::emit_budget_check(int executed, int pc) {
+	emit({ 0x83, 0xF9, (byte)executed }); // cmp ecx, executed
+	emit({ 0x75, 0x06 }); // jne over the return
+	emit_return(pc);
+}
+
+// Returns pc + 4 if the skip condition holds and pc + 2 otherwise
+void Chip8Jit::emit_skip(const Chip8Instruction& instr, int pc) {
+	emit({ 0xB8 }); // mov eax, pc + 2
+	emit_imm32(pc + 2);
+	emit({ 0x41, 0xB8 }); // mov r8d, pc + 4
+	emit_imm32(pc + 4);
+
+	emit_load_v(REG_R9D, instr.x);
+	if (instr.opcode == OP_3xkk || instr.opcode == OP_4xkk) {
+		emit({ 0x41, 0x81, 0xF9 }); // cmp r9d, kk
+		emit_imm32(instr.kk);
+	} else {
+		emit_load_v(REG_R10D, instr.y);
+		emit_alu(ALU_CMP, REG_R9D, REG_R10D);
+	}
+
+	if (instr.opcode == OP_3xkk || instr.opcode == OP_5xy0) {
+		emit({ 0x41, 0x0F, 0x44, 0xC0 }); // cmove eax, r8d
+	} else {
+		emit({ 0x41, 0x0F, 0x45, 0xC0 }); // cmovne eax, r8d
+	}
+	emit({ 0xC3 });
+}
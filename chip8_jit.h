@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+
+#include "chip8.h"
+
+// The recompiler emits x86-64 code for the System V calling convention (Linux and other Unix-likes).
+// Everywhere else Chip8Jit just runs the interpreter.
+#if defined(__x86_64__) && defined(__unix__)
+#define CHIP8_JIT_SUPPORTED 1
+#else
+#define CHIP8_JIT_SUPPORTED 0
+#endif
+
+// Size of the executable memory for compiled blocks. Everything is thrown away when it fills up.
+#define JIT_CODE_BUFFER_SIZE (1024 * 1024)
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+// Code that was written to this many times is considered self-modifying and is always interpreted
+#define JIT_SELF_MODIFYING_WRITES 2
+
+/*
+Dynamic recompiler that translates runs of CHIP-8 instructions into native code.
+
+A block is a run of register-only instructions (6xkk, 7xkk, 8xy?, Annn, Fx07, Fx15, Fx1E, Fx29),
+optionally ended by a jump (1nnn) or a skip (3xkk, 4xkk, 5xy0, 9xy0), which are compiled as
+well. Any other instruction (calls, returns, drawing, memory access, input, sound, RND, ...) ends
+the block and is executed by the interpreter, so compiled code never touches memory, the stack or
+the host. LD ST, Vx is one of them because the host is told when the sound timer is set.
+
+Fx33, Fx55 and 5xy2 are always interpreted, so the recompiler sees every memory write and throws
+away the blocks that cover the written bytes. Only code in the first MEM_SIZE bytes is compiled, the
+rest of XO-CHIP memory is always interpreted.
+
+Every instruction after the first in a block starts with a check of the cycle budget the block was
+entered with, and the block returns there once the budget is used up. So the recompiler executes
+exactly as many instructions per run as the interpreter does, and timers, sound and movies see the
+same cycles with and without it.
+
+In lockstep mode a second interpreter executes the same instructions as every block, starting
+from the same state, and any difference in the registers throws, as does a run that executes more
+instructions than it was given.
+*/
+class Chip8Jit {
+	struct Block {
+		int start;
+		int end; // One past the last byte the block depends on, which includes the instruction after a skip
+		int instruction_count;
+		byte* code;
+		bool valid;
+		// Starts with a jump 4 bytes back, which can be the end of a timer wait loop
+		bool jumps_back;
+	};
+	// Compiled blocks execute up to max_instructions (at least 1) of their instructions and return the new PC
+	typedef int (*BlockFunction)(byte* V_registers, unsigned short* I_register, byte* DT_register, int max_instructions);
+
+	// Values of block_at for addresses without a valid block
+	static const short BLOCK_NOT_COMPILED = -1;
+	static const short BLOCK_NOT_COMPILABLE = -2;
+
+	Chip8& emu;
+	Chip8* shadow = nullptr;
+
+	byte* code_buffer = nullptr;
+	int code_size = 0;
+	std::vector<Block> blocks;
+	// Index into blocks of the block starting at every address
+	short block_at[MEM_SIZE];
+	// How many times every address was written to, saturating
+	byte write_count[MEM_SIZE] = {};
+	// The interpreter's memory generation the blocks were compiled from
+	int memory_generation;
+public:
+	// Recompile the code of the specified interpreter. In lockstep mode every compiled block is
+	// checked against the interpreter.
+	Chip8Jit(Chip8& emu, bool lockstep = false);
+	~Chip8Jit();
+	Chip8Jit(const Chip8Jit&) = delete;
+	Chip8Jit& operator=(const Chip8Jit&) = delete;
+
+	// Execute up to the specified number of instructions, like Chip8::run, with compiled blocks where
+	// possible. Returns early when an instruction draws, waits for a key, exits or faults. Timer wait
+	// loops are left to the interpreter, which skips the rest of the budget (STOP_IDLE) the same way.
+	Chip8StopReason run(long long cycles);
+private:
+	// Execute a single instruction with the interpreter
+	Chip8StopReason interpret();
+	// Whether the instruction at pc is the jump back of a timer wait loop the interpreter would skip
+	bool is_idle_jump(int pc) const;
+	// Execute up to max_cycles instructions of a block. Returns the number of instructions executed.
+	int run_block(const Block& block, int max_cycles);
+	void check_lockstep(const Block& block, int instruction_count);
+
+	// Compile the block starting at the specified address. Returns its index or BLOCK_NOT_COMPILABLE.
+	short compile(int start);
+	bool is_compilable(int addr) const;
+	// Whether the code buffer can take one more instruction and the return after it
+	bool has_room_for_instruction() const;
+	void invalidate(int addr, int size);
+	void flush();
+
+	void emit(std::initializer_list<byte> bytes);
+	void emit_imm32(int value);
+	void emit_load_v(int reg, int v);
+	void emit_store_v(int v, int reg);
+	void emit_alu(byte opcode, int dst_reg, int src_reg);
+	void emit_return(int pc);
+	void emit_budget_check(int executed, int pc);
+	void emit_skip(const Chip8Instruction& instr, int pc);
+};
@@ -0,0 +1,82 @@
+#include "chip8.h"
+
+#ifdef CHIP8_PROFILE
+
+void Chip8Profile::clear() {
+	// Not by assigning a new Chip8Profile, which would put all of it on the stack
+	std::fill(std::begin(opcode_counts), std::end(opcode_counts), 0);
+	std::fill(std::begin(address_counts), std::end(address_counts), 0);
+	pixels_drawn = 0;
+	pixels_erased = 0;
+	collisions = 0;
+	key_wait_cycles = 0;
+	idle_cycles = 0;
+}
+
+void Chip8Profile::add(const Chip8Profile& other) {
+	for (int i = 0; i < OP_COUNT; i++) {
+		opcode_counts[i] += other.opcode_counts[i];
+	}
+	for (int i = 0; i < MAX_MEM_SIZE; i++) {
+		address_counts[i] += other.address_counts[i];
+	}
+	pixels_drawn += other.pixels_drawn;
+	pixels_erased += other.pixels_erased;
+	collisions += other.collisions;
+	key_wait_cycles += other.key_wait_cycles;
+	idle_cycles += other.idle_cycles;
+}
+
+void Chip8Profile::save_csv(const char* filename) const {
+	std::ofstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to create profile file");
+	}
+
+	file << "section,name,count\n";
+	for (int i = 0; i < OP_COUNT; i++) {
+		if (opcode_counts[i]) {
+			file << "opcode," << get_opcode_name(i) << "," << opcode_counts[i] << "\n";
+		}
+	}
+	for (int addr = 0; addr < MAX_MEM_SIZE; addr++) {
+		if (address_counts[addr]) {
+			file << "address,0x" << std::hex << addr << std::dec << "," << address_counts[addr] << "\n";
+		}
+	}
+	file << "draw,pixels_drawn," << pixels_drawn << "\n";
+	file << "draw,pixels_erased," << pixels_erased << "\n";
+	file << "draw,collisions," << collisions << "\n";
+	file << "wait,key_wait_cycles," << key_wait_cycles << "\n";
+	file << "wait,idle_cycles," << idle_cycles << "\n";
+
+	if (!file) {
+		throw std::runtime_error("Failed to write profile file");
+	}
+}
+
+void Chip8Profile::save_binary(const char* filename) const {
+	Chip8ProfileHeader header;
+	std::memcpy(header.magic, "C8PF", 4);
+	header.version = CHIP8_PROFILE_VERSION;
+	header.opcode_count = OP_COUNT;
+	header.memory_size = MAX_MEM_SIZE;
+
+	std::ofstream file(filename, std::ios::out | std::ios::binary);
+	if (!file.write((const char*)&header, sizeof(header)) || !file.write((const char*)this, sizeof(*this))) {
+		throw std::runtime_error("Failed to write profile file");
+	}
+}
+
+const char* Chip8Profile::get_opcode_name(int opcode) {
+	static const char* const names[OP_COUNT] = {
+		"not_decoded",
+#define CHIP8_OPCODE_NAME(name) #name,
+		CHIP8_INSTRUCTIONS(CHIP8_OPCODE_NAME)
+		CHIP8_FUSED_INSTRUCTIONS(CHIP8_OPCODE_NAME)
+#undef CHIP8_OPCODE_NAME
+	};
+	return (opcode >= 0 && opcode < OP_COUNT) ? names[opcode] : "invalid";
+}
+
+#endif
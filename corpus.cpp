@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "corpus.h"
+#include "headless_host.h"
+#include "scheduler.h"
+#include "thread_pool.h"
+
+std::vector<InputEvent> load_input_script(const char* filename) {
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to open input script");
+	}
+
+	std::vector<InputEvent> script;
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		std::istringstream fields(line);
+		InputEvent event;
+		std::string state;
+		if (!(fields >> event.frame >> std::hex >> event.key >> state) || event.frame < 0 || event.key < 0
+			|| event.key > 0xF || (state != "down" && state != "up")) {
+			throw std::runtime_error("Invalid input script line: " + line);
+		}
+		event.is_down = state == "down";
+		script.push_back(event);
+	}
+
+	// Events of the same frame keep their order
+	std::stable_sort(script.begin(), script.end(),
+		[](const InputEvent& a, const InputEvent& b) { return a.frame < b.frame; });
+	return script;
+}
+
+SessionResult run_session(const std::string& rom_filename, const std::vector<InputEvent>& script,
+	const CorpusOptions& options) {
+	SessionResult result;
+	result.rom_filename = rom_filename;
+	auto start_time = std::chrono::steady_clock::now();
+
+	try {
+		HeadlessHost host;
+		Chip8 emu(rom_filename.c_str(), host, options.seed);
+		emu.set_variant(options.variant);
+		emu.set_quirks(options.quirks);
+		Scheduler scheduler(options.instructions_per_second);
+		scheduler.set_uncapped();
+
+		uint64_t frames_hash = 14695981039346656037ull;
+		size_t next_event = 0;
+		for (long long frame = 0; frame < options.frames; frame++) {
+			while (next_event < script.size() && script[next_event].frame <= frame) {
+				host.set_key_state(script[next_event].key, script[next_event].is_down);
+				next_event++;
+			}
+
+			long long frame_start = emu.get_cycle_count();
+			Chip8StopReason reason = emu.run(scheduler.begin_frame());
+			if (reason == STOP_FAULT) {
+				result.error = Chip8::get_trap_message(emu.get_trap());
+				break;
+			}
+			emu.step_clocks();
+			scheduler.end_frame(emu.get_cycle_count() - frame_start);
+
+			if (emu.get_dirty_rows()) {
+				host.present(emu);
+				emu.clear_dirty_rows();
+				frames_hash = emu.get_screen_hash(frames_hash);
+			}
+			if (reason == STOP_EXIT) {
+				break;
+			}
+		}
+
+		result.frames = scheduler.get_emulated_frames();
+		result.instructions = emu.get_cycle_count();
+		result.frames_presented = host.get_frames_presented();
+		result.final_hash = emu.get_screen_hash();
+		result.frames_hash = frames_hash;
+#ifdef CHIP8_PROFILE
+		result.profile.reset(new Chip8Profile(emu.get_profile()));
+#endif
+	}
+	catch (const std::runtime_error& err) {
+		result.error = err.what();
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+	result.seconds = elapsed.count();
+	return result;
+}
+
+std::vector<SessionResult> run_corpus(const std::vector<std::string>& rom_filenames,
+	const std::vector<InputEvent>& script, const CorpusOptions& options) {
+	std::vector<SessionResult> results(rom_filenames.size());
+	ThreadPool pool(options.threads);
+	for (size_t i = 0; i < rom_filenames.size(); i++) {
+		// Every session writes to its own result, so they don't need to synchronize
+		pool.submit([&, i] { results[i] = run_session(rom_filenames[i], script, options); });
+	}
+	pool.wait();
+	return results;
+}
+
+std::vector<std::string> list_corpus(const char* directory) {
+	std::vector<std::string> filenames;
+	std::error_code error;
+	for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory, error)) {
+		if (entry.is_regular_file()) {
+			filenames.push_back(entry.path().string());
+		}
+	}
+	if (error) {
+		throw std::runtime_error("Failed to list corpus directory");
+	}
+	std::sort(filenames.begin(), filenames.end());
+	return filenames;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+// A key press or release at the start of an emulated frame
+struct InputEvent {
+	long long frame;
+	int key;
+	bool is_down;
+};
+
+// Load an input script, one event per line: "FRAME KEY down" or "FRAME KEY up", with KEY in hex
+// (0-F). Empty lines and lines starting with # are ignored. Throws std::runtime_error on errors.
+std::vector<InputEvent> load_input_script(const char* filename);
+
+struct SessionResult {
+	std::string rom_filename;
+	long long frames = 0;
+	long long instructions = 0;
+	long long frames_presented = 0;
+	// Hash of the screen after the last frame
+	uint64_t final_hash = 0;
+	// Hash of every presented frame, in order
+	uint64_t frames_hash = 0;
+	// Empty if the session ran to the end
+	std::string error;
+	double seconds = 0;
+#ifdef CHIP8_PROFILE
+	// Null if the session didn't run to the end
+	std::unique_ptr<Chip8Profile> profile;
+#endif
+};
+
+struct CorpusOptions {
+	long long frames = 60 * 60;
+	int instructions_per_second = 540;
+	int threads = 0; // One per core
+	uint64_t seed = 0; // RND seed of every session
+	Chip8Variant variant = VARIANT_CHIP8;
+	int quirks = 0;
+};
+
+// Run a rom headless for options.frames emulated frames, feeding it the scripted input
+SessionResult run_session(const std::string& rom_filename, const std::vector<InputEvent>& script,
+	const CorpusOptions& options);
+// Run every rom on a work-stealing thread pool. The results are in the same order as the roms.
+std::vector<SessionResult> run_corpus(const std::vector<std::string>& rom_filenames,
+	const std::vector<InputEvent>& script, const CorpusOptions& options);
+// The regular files in a directory, sorted by name
+std::vector<std::string> list_corpus(const char* directory);
@@ -0,0 +1,47 @@
+#include "frame_handoff.h"
+
+FrameHandoff::FrameHandoff(int width, int height) : width(width), height(height) {
+	for (int i = 0; i < 3; i++) {
+		buffers[i].assign((size_t)width * height, 0);
+		stale_rows[i] = ~0ull;
+	}
+}
+
+int FrameHandoff::get_width() const {
+	return width;
+}
+
+int FrameHandoff::get_height() const {
+	return height;
+}
+
+uint64_t FrameHandoff::mark_changed_rows(uint64_t changed_rows) {
+	for (int i = 0; i < 3; i++) {
+		stale_rows[i] |= changed_rows;
+	}
+	uint64_t rows = stale_rows[back];
+	stale_rows[back] = 0;
+	return rows;
+}
+
+uint32_t* FrameHandoff::get_back_buffer() {
+	return buffers[back].data();
+}
+
+void FrameHandoff::publish() {
+	// Release makes the pixels visible to the consumer before the index, acquire gets back a buffer
+	// the consumer is done reading
+	back = middle.exchange(back | FRAME_READY, std::memory_order_acq_rel) & ~FRAME_READY;
+}
+
+bool FrameHandoff::acquire() {
+	if (!(middle.load(std::memory_order_relaxed) & FRAME_READY)) {
+		return false;
+	}
+	front = middle.exchange(front, std::memory_order_acq_rel) & ~FRAME_READY;
+	return true;
+}
+
+const uint32_t* FrameHandoff::get_front_buffer() const {
+	return buffers[front].data();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+Hands finished frames of 32-bit pixels from the emulation thread to the presenting thread without
+locks, with three buffers. The producer draws into the back buffer and publishes it, which swaps it
+with the middle one; the consumer swaps the middle one with its front buffer when a new frame is
+there. Neither side ever waits for the other: the producer always has a free buffer to draw into,
+and the consumer always gets the newest frame, skipping the ones it was too slow for.
+
+Every buffer remembers which screen rows changed since it was last drawn, so the producer only has
+to scale the rows that are out of date in the buffer it got back.
+*/
+class FrameHandoff {
+	// Set in middle when the middle buffer holds a frame the consumer didn't take yet
+	static const int FRAME_READY = 4;
+
+	std::vector<uint32_t> buffers[3];
+	uint64_t stale_rows[3];
+	int width;
+	int height;
+
+	int back = 0;
+	std::atomic<int> middle{1};
+	int front = 2;
+public:
+	FrameHandoff(int width, int height);
+	FrameHandoff(const FrameHandoff&) = delete;
+	FrameHandoff& operator=(const FrameHandoff&) = delete;
+
+	int get_width() const;
+	int get_height() const;
+
+	// Producer side. Marks the rows changed in every buffer and returns the rows the back buffer has
+	// to be redrawn in, which are then considered up to date.
+	uint64_t mark_changed_rows(uint64_t changed_rows);
+	uint32_t* get_back_buffer();
+	// Make the back buffer the newest frame
+	void publish();
+
+	// Consumer side. Takes the newest frame if there is one the consumer didn't see yet, and returns
+	// whether there was.
+	bool acquire();
+	// The newest frame the consumer took (black before the first one)
+	const uint32_t* get_front_buffer() const;
+};
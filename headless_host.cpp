@@ -0,0 +1,108 @@
+#include <bitset>
+#include <thread>
+
+#include "chip8.h"
+#include "headless_host.h"
+
+HeadlessHost::HeadlessHost() {}
+
+void HeadlessHost::set_key_state(int key_number, bool is_down) {
+	if (is_down && !key_states[key_number] && key_capture) {
+		last_key = key_number;
+		key_capture = false;
+	}
+	key_states[key_number] = is_down;
+}
+
+long long HeadlessHost::get_frames_presented() const {
+	return frames_presented;
+}
+
+long long HeadlessHost::get_rows_presented() const {
+	return rows_presented;
+}
+
+void HeadlessHost::enable_framebuffer(int scale, uint32_t off_color, uint32_t on_color, ScaleMode mode) {
+	scaler.reset(new Scaler(scale, scale, off_color, on_color, mode));
+	framebuffer_scale = scale;
+	framebuffer_off_color = off_color;
+	framebuffer_screen_width = SCREEN_WIDTH;
+	framebuffer_screen_height = SCREEN_HEIGHT;
+	framebuffer.assign(get_framebuffer_width() * get_framebuffer_height(), off_color);
+}
+
+const uint32_t* HeadlessHost::get_framebuffer() const {
+	return framebuffer.data();
+}
+
+int HeadlessHost::get_framebuffer_width() const {
+	return framebuffer_screen_width * framebuffer_scale;
+}
+
+int HeadlessHost::get_framebuffer_height() const {
+	return framebuffer_screen_height * framebuffer_scale;
+}
+
+bool HeadlessHost::is_key_down(int key_number) {
+	return key_states[key_number];
+}
+
+void HeadlessHost::enable_key_capture() {
+	key_capture = true;
+}
+
+// Returns the captured key number, or -1 if not captured yet
+int HeadlessHost::get_capture_key() {
+	if (key_capture) {
+		return -1;
+	} else {
+		return last_key;
+	}
+}
+
+bool HeadlessHost::process_events() {
+	// The samples of the frames since the last call
+	if (wav) {
+		wav->drain(*audio_ring);
+	}
+	return true;
+}
+
+void HeadlessHost::present(const Chip8& emu) {
+	// Nothing to show, we only keep count and update the framebuffer if there is one.
+	frames_presented++;
+	rows_presented += std::bitset<64>(emu.get_dirty_rows()).count();
+	if (scaler) {
+		int width = emu.get_screen_width();
+		int height = emu.get_screen_height();
+		if (width != framebuffer_screen_width) {
+			// Switching the resolution clears the screen, so every row is dirty anyway
+			framebuffer_screen_width = width;
+			framebuffer_screen_height = height;
+			framebuffer.assign(get_framebuffer_width() * get_framebuffer_height(), framebuffer_off_color);
+		}
+		if (emu.get_variant() == VARIANT_XOCHIP) {
+			scaler->scale_planes(emu.get_screen_rows(0), emu.get_screen_rows(1), width, height, emu.get_dirty_rows(),
+				framebuffer.data(), get_framebuffer_width());
+		} else {
+			scaler->scale(emu.get_screen_rows(), width, height, emu.get_dirty_rows(), framebuffer.data(),
+				get_framebuffer_width());
+		}
+	}
+}
+
+void HeadlessHost::wait_until(std::chrono::steady_clock::time_point deadline) {
+	std::this_thread::sleep_until(deadline);
+}
+
+void HeadlessHost::start_audio(AudioRing& ring, Beeper& beeper, WavWriter& wav) {
+	audio_ring = &ring;
+	this->beeper = &beeper;
+	this->wav = &wav;
+}
+
+void HeadlessHost::sound_changed(const Chip8& emu) {
+	if (beeper) {
+		beeper->sound_changed(emu);
+	}
+}
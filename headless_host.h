@@ -0,0 +1,65 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "audio.h"
+#include "chip8_host.h"
+#include "scaler.h"
+
+/*
+Runs the interpreter without a window. Keys are driven programmatically and
+frames are only counted (or scaled into a framebuffer), which makes it
+suitable for servers and automated runs. All state is per instance, so every
+thread can run its own hosts.
+*/
+class HeadlessHost : public Chip8Host {
+	bool key_states[16] = {};
+	bool key_capture = false;
+	int last_key = -1;
+
+	long long frames_presented = 0;
+	long long rows_presented = 0;
+
+	// Output pixels, only kept up to date after enable_framebuffer
+	std::unique_ptr<Scaler> scaler;
+	std::vector<uint32_t> framebuffer;
+	int framebuffer_scale = 0;
+	uint32_t framebuffer_off_color = 0;
+	// In screen pixels, the framebuffer follows the screen into and out of the high resolution mode
+	int framebuffer_screen_width = 0;
+	int framebuffer_screen_height = 0;
+
+	// Sound, only produced after start_audio
+	AudioRing* audio_ring = nullptr;
+	Beeper* beeper = nullptr;
+	WavWriter* wav = nullptr;
+public:
+	HeadlessHost();
+
+	// Press or release one of the 16 keys
+	void set_key_state(int key_number, bool is_down);
+
+	long long get_frames_presented() const;
+	long long get_rows_presented() const;
+
+	// Keep a 32-bit pixel image of the screen, scaled up by an integer factor, for encoding or dumping
+	// frames. XO-CHIP screens are drawn in the four colors of both planes.
+	void enable_framebuffer(int scale, uint32_t off_color, uint32_t on_color, ScaleMode mode = SCALE_NEAREST);
+	const uint32_t* get_framebuffer() const;
+	int get_framebuffer_width() const;
+	int get_framebuffer_height() const;
+
+	// Write the sound to a WAV file: beeper fills the ring during every frame and process_events
+	// drains it into the file. All three must outlive the host.
+	void start_audio(AudioRing& ring, Beeper& beeper, WavWriter& wav);
+
+	bool is_key_down(int key_number) override;
+	void enable_key_capture() override;
+	int get_capture_key() override;
+
+	bool process_events() override;
+	void present(const Chip8& emu) override;
+	void wait_until(std::chrono::steady_clock::time_point deadline) override;
+	void sound_changed(const Chip8& emu) override;
+};
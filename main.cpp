@@ -1,107 +1,484 @@
 #include <cstdlib>
+#include <chrono>
 #include <ctime>
-#include <windows.h>
+#include <exception>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
 
+#include "audio.h"
 #include "chip8.h"
+#include "chip8_jit.h"
+#include "corpus.h"
+#include "movie.h"
+#include "rewind.h"
+#include "scheduler.h"
+#ifdef _WIN32
 #include "windows_bindings.h"
+#else
+#include "headless_host.h"
+#endif
 
 // The clock speed of CHIP-8 is not formally defined, and it seems that the clock
-// speed changed depending on which computer the game was intended to run on, so 
-// allowing the users to change it based on the game might be needed.
+// speed changed depending on which computer the game was intended to run on, so
+// the default can be changed with --hz.
 #define CLOCK_SPEED_HZ 540
+// Longest time to sleep while waiting for a key with nothing else to do, so the host still gets to
+// handle its events regularly
+#define INPUT_WAIT_MS 250
+// Memory budget of the rewind history per second of it. A typical frame changes a few dozen bytes of
+// state, so this only runs out when nearly the whole screen changes every frame, and then the oldest
+// frames are dropped early.
+#define REWIND_BYTES_PER_SECOND (60 * 1024)
+
+// Runs the interpreter, or the recompiler if one is given, until the host asks to stop, the program
+// exits or frame_limit emulated frames ran (a negative limit means no limit). Every frame is
+// recorded in rewind if one is given, and played back while the host asks to rewind. The recorder,
+// if given, is told about the end of every frame, and so is the beeper (which stays silent while
+// rewinding).
+void run_emulator(Chip8& emu, Chip8Host& host, Scheduler& scheduler, Chip8Jit* jit, RewindBuffer* rewind,
+	MovieRecorder* recorder, Beeper* beeper, long long frame_limit) {
+	if (rewind) {
+		rewind->push(emu);
+	}
+	while (host.process_events() && (frame_limit < 0 || scheduler.get_emulated_frames() < frame_limit)) {
+		if (rewind && host.is_rewinding()) {
+			// One frame back per 60Hz frame of wall time. Emulated time doesn't advance, the scheduler
+			// just continues from the restored state once rewinding stops.
+			if (rewind->step_back(emu)) {
+				host.present(emu);
+				emu.clear_dirty_rows();
+			}
+			host.wait_until(std::chrono::steady_clock::now() + std::chrono::microseconds(1000000 / 60));
+			continue;
+		}
+
+		// Execute number of interpreter instructions to simulate the relevant clock speed
+		// The frame ends early when drawing (a few websites say that the original interpreter blocked
+		// when drawing until the next vertical blank) or when waiting for a key press.
+		int instructions_per_frame = scheduler.begin_frame();
+		long long frame_start = emu.get_cycle_count();
+		if (beeper) {
+			beeper->begin_frame(emu);
+		}
+		Chip8StopReason reason = jit ? jit->run(instructions_per_frame) : emu.run(instructions_per_frame);
+		if (reason == STOP_FAULT) {
+			throw std::runtime_error(Chip8::get_trap_message(emu.get_trap()));
+		}
+		if (beeper) {
+			// The sound timer still has the value it had during the frame
+			beeper->end_frame(emu);
+		}
+		emu.step_clocks(); // Update internal clocks every emulated 60HZ frame
+		if (recorder) {
+			recorder->end_frame();
+		}
+		if (rewind) {
+			rewind->push(emu);
+		}
+
+		if (scheduler.end_frame(emu.get_cycle_count() - frame_start)) {
+			// If drawing instructions changed any pixels, we need to update the real screen.
+			if (emu.get_dirty_rows()) {
+				host.present(emu);
+				emu.clear_dirty_rows();
+			}
+			std::chrono::steady_clock::time_point deadline = scheduler.present_done();
+			if (emu.is_waiting_for_input() && scheduler.get_speed_mode() != SPEED_UNCAPPED) {
+				// Until a key is pressed every frame would be the same, so instead of waking up every
+				// frame we sleep until there is input. The scheduler doesn't try to catch up afterwards.
+				host.wait_for_input(deadline + std::chrono::milliseconds(INPUT_WAIT_MS));
+			} else {
+				host.wait_until(deadline);
+			}
+		}
+		if (emu.has_exited()) {
+			break;
+		}
+	}
+}
+
+// Parse the value of --variant
+bool parse_variant(const std::string& name, Chip8Variant& variant) {
+	for (int i = 0; i < VARIANT_COUNT; i++) {
+		if (name == Chip8::get_variant_name((Chip8Variant)i)) {
+			variant = (Chip8Variant)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parse the value of --quirks, a comma separated list of quirk names or "none"
+bool parse_quirks(const std::string& list, int& quirks) {
+	// In the order of the CHIP8_QUIRK_* bits
+	static const char* const names[] = { "shift-vy", "load-store-i", "clip-sprites" };
+	quirks = 0;
+	if (list == "none") {
+		return true;
+	}
+	std::istringstream stream(list);
+	std::string name;
+	while (std::getline(stream, name, ',')) {
+		int bit = 0;
+		while (bit < 3 && name != names[bit]) {
+			bit++;
+		}
+		if (bit == 3) {
+			return false;
+		}
+		quirks |= 1 << bit;
+	}
+	return true;
+}
+
+#ifdef CHIP8_PROFILE
+// Output files of --profile and --profile-binary
+static const char* profile_filename = nullptr;
+static const char* profile_binary_filename = nullptr;
+
+void save_profile(const Chip8Profile& profile) {
+	if (profile_filename) {
+		profile.save_csv(profile_filename);
+	}
+	if (profile_binary_filename) {
+		profile.save_binary(profile_binary_filename);
+	}
+}
+#endif
+
+// Run every rom in a directory headless on all cores and print a line of results per rom
+int run_corpus_mode(const char* directory, const char* script_filename, const CorpusOptions& options) {
+	try {
+		std::vector<InputEvent> script;
+		if (script_filename) {
+			script = load_input_script(script_filename);
+		}
+		std::vector<std::string> roms = list_corpus(directory);
+
+		auto start_time = std::chrono::steady_clock::now();
+		std::vector<SessionResult> results = run_corpus(roms, script, options);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+
+		long long total_instructions = 0;
+		std::cout << "rom,frames,instructions,presented,final_hash,frames_hash,seconds,error" << std::endl;
+		for (const SessionResult& result : results) {
+			std::cout << result.rom_filename << "," << result.frames << "," << result.instructions << ","
+				<< result.frames_presented << "," << std::hex << result.final_hash << "," << result.frames_hash
+				<< std::dec << "," << result.seconds << ",\"" << result.error << "\"" << std::endl;
+			total_instructions += result.instructions;
+		}
+		std::cerr << "Ran " << results.size() << " roms (" << total_instructions << " instructions) in "
+			<< elapsed.count() << "s" << std::endl;
+#ifdef CHIP8_PROFILE
+		// The whole corpus in one profile, to see which instructions the rom mix depends on
+		std::unique_ptr<Chip8Profile> total_profile(new Chip8Profile());
+		for (const SessionResult& result : results) {
+			if (result.profile) {
+				total_profile->add(*result.profile);
+			}
+		}
+		save_profile(*total_profile);
+#endif
+	}
+	catch (const std::runtime_error& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+// Replay a movie as fast as possible and check every screen hash in it
+int run_replay_mode(const char* rom_filename, const char* movie_filename) {
+	try {
+		Movie movie = Movie::load(movie_filename);
+		MovieReplayResult result = replay_movie(rom_filename, movie);
+		std::cout << "Replayed " << result.frames << " of " << movie.frames << " frames (" << result.instructions
+			<< " instructions) in " << result.seconds << "s, " << result.checkpoints_passed << " of "
+			<< movie.checkpoints.size() << " checkpoints matched" << std::endl;
+		if (result.mismatch_frame != -1) {
+			std::cout << "Screen hash mismatch after frame " << result.mismatch_frame << ": expected " << std::hex
+				<< result.expected_hash << ", got " << result.actual_hash << std::dec << std::endl;
+		}
+		if (!result.error.empty()) {
+			std::cout << "Fault: " << result.error << std::endl;
+		}
+		return result.is_ok() ? 0 : 1;
+	}
+	catch (const std::runtime_error& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
+}
 
 int main(int argc, char** argv) {
-	// Seed PRNG
-	srand(time(0));
+	const char* rom_filename = nullptr;
+	int clock_speed_hz = CLOCK_SPEED_HZ;
+	int fast_forward = 1;
+	bool uncapped = false;
+	long long frame_limit = -1;
+	bool use_jit = false;
+	bool jit_lockstep = false;
+	const char* corpus_directory = nullptr;
+	const char* script_filename = nullptr;
+	const char* load_state_filename = nullptr;
+	const char* save_state_filename = nullptr;
+	int threads = 0;
+	int rewind_seconds = 0;
+	const char* record_filename = nullptr;
+	const char* replay_filename = nullptr;
+	const char* wav_filename = nullptr;
+	// Without --variant or --quirks the interpreter behaves as it always did, with no quirks
+	Chip8Variant variant = VARIANT_CHIP8;
+	bool has_variant = false;
+	int quirks = 0;
+	bool has_quirks = false;
+	// Interactive sessions get different random numbers every time, automated runs are reproducible
+#ifdef _WIN32
+	uint64_t seed = (uint64_t)time(0);
+#else
+	uint64_t seed = 0;
+#endif
+#ifndef _WIN32
+	// Headless runs are for automation, so they default to running as fast as possible for a minute
+	// of emulated time.
+	uncapped = true;
+	frame_limit = 60 * 60;
+#endif
 
-	if (argc != 2) {
-		std::cerr << "Usage: " << argv[0] << " ROM_FILE" << std::endl;
+	bool valid_arguments = true;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--hz" && has_value) {
+			clock_speed_hz = atoi(argv[++i]);
+		} else if (arg == "--speed" && has_value) {
+			fast_forward = atoi(argv[++i]);
+			uncapped = false;
+		} else if (arg == "--realtime") {
+			fast_forward = 1;
+			uncapped = false;
+		} else if (arg == "--uncapped") {
+			uncapped = true;
+		} else if (arg == "--frames" && has_value) {
+			frame_limit = atoll(argv[++i]);
+		} else if (arg == "--jit") {
+			use_jit = true;
+		} else if (arg == "--jit-lockstep") {
+			use_jit = true;
+			jit_lockstep = true;
+		} else if (arg == "--variant" && has_value) {
+			has_variant = true;
+			valid_arguments = valid_arguments && parse_variant(argv[++i], variant);
+		} else if (arg == "--quirks" && has_value) {
+			has_quirks = true;
+			valid_arguments = valid_arguments && parse_quirks(argv[++i], quirks);
+		} else if (arg == "--seed" && has_value) {
+			seed = strtoull(argv[++i], nullptr, 10);
+		} else if (arg == "--load-state" && has_value) {
+			load_state_filename = argv[++i];
+		} else if (arg == "--save-state" && has_value) {
+			save_state_filename = argv[++i];
+		} else if (arg == "--rewind" && has_value) {
+			rewind_seconds = atoi(argv[++i]);
+		} else if (arg == "--record" && has_value) {
+			record_filename = argv[++i];
+		} else if (arg == "--replay" && has_value) {
+			replay_filename = argv[++i];
+#ifndef _WIN32
+		} else if (arg == "--wav" && has_value) {
+			wav_filename = argv[++i];
+#endif
+#ifdef CHIP8_PROFILE
+		} else if (arg == "--profile" && has_value) {
+			profile_filename = argv[++i];
+		} else if (arg == "--profile-binary" && has_value) {
+			profile_binary_filename = argv[++i];
+#endif
+		} else if (arg == "--corpus" && has_value) {
+			corpus_directory = argv[++i];
+		} else if (arg == "--script" && has_value) {
+			script_filename = argv[++i];
+		} else if (arg == "--threads" && has_value) {
+			threads = atoi(argv[++i]);
+		} else if (!rom_filename && arg[0] != '-') {
+			rom_filename = argv[i];
+		} else {
+			valid_arguments = false;
+		}
+	}
+
+	if (!valid_arguments || (!rom_filename && !corpus_directory) || clock_speed_hz <= 0 || fast_forward <= 0
+		|| rewind_seconds < 0
+		// A movie starts from power on and every frame runs in the interpreter, in order
+		|| (record_filename && (use_jit || rewind_seconds || load_state_filename))) {
+		std::cerr << "Usage: " << argv[0] << " ROM_FILE [--hz CLOCK_SPEED] [--realtime | --speed FACTOR | --uncapped]"
+			<< " [--frames FRAMES] [--seed SEED] [--jit | --jit-lockstep] [--load-state FILE] [--save-state FILE]"
+			<< " [--rewind SECONDS | --record MOVIE_FILE] [--variant chip8|schip|xochip] [--quirks QUIRKS]" << std::endl;
+		std::cerr << "       " << argv[0] << " ROM_FILE --replay MOVIE_FILE" << std::endl;
+		std::cerr << "       " << argv[0] << " --corpus ROM_DIRECTORY [--script INPUT_SCRIPT] [--threads THREADS]"
+			<< " [--hz CLOCK_SPEED] [--frames FRAMES] [--seed SEED] [--variant VARIANT] [--quirks QUIRKS]" << std::endl;
+#ifndef _WIN32
+		std::cerr << "Headless: --wav WAV_FILE writes the sound of the session, in emulated time" << std::endl;
+#endif
+		std::cerr << "QUIRKS is none or a comma separated list of shift-vy, load-store-i and clip-sprites. They"
+			<< " default to the usual ones of the variant." << std::endl;
+#ifdef CHIP8_PROFILE
+		std::cerr << "Profiling build: --profile CSV_FILE and --profile-binary FILE save execution counts" << std::endl;
+#endif
 		return 1;
 	}
 
+	if (!has_quirks) {
+		quirks = has_variant ? Chip8::get_variant_quirks(variant) : 0;
+	}
+
+	if (corpus_directory) {
+		CorpusOptions options;
+		options.variant = variant;
+		options.quirks = quirks;
+		options.instructions_per_second = clock_speed_hz;
+		options.threads = threads;
+		options.seed = seed;
+		if (frame_limit >= 0) {
+			options.frames = frame_limit;
+		}
+		return run_corpus_mode(corpus_directory, script_filename, options);
+	}
+	if (replay_filename) {
+		return run_replay_mode(rom_filename, replay_filename);
+	}
+
+	Scheduler scheduler(clock_speed_hz);
+	if (uncapped) {
+		scheduler.set_uncapped();
+	} else if (fast_forward > 1) {
+		scheduler.set_fast_forward(fast_forward);
+	}
+
 	try {
-		Chip8 emu(argv[1]);
-
-		setup_window();
-
-		int instructions_per_60hz = CLOCK_SPEED_HZ / 60;
-		LARGE_INTEGER perf_count_freq;
-		QueryPerformanceFrequency(&perf_count_freq);
-		LARGE_INTEGER last_perf_count;
-		QueryPerformanceCounter(&last_perf_count);
-
-		// We sleep to yield time to the cpu, so we set the clock precision so
-		// we can be sure we don't over-sleep.
-		timeBeginPeriod(1);
-
-		bool running = true;
-		MSG message;
-		while (running) {
-			// Handle Windows message loop
-			while (PeekMessage(&message, 0, 0, 0, PM_REMOVE)) {
-				if (message.message == WM_QUIT) {
-					running = false;
-				}
+#ifdef _WIN32
+		WindowsHost host;
+#else
+		HeadlessHost host;
+#endif
+		// The optional parts are freed however the session ends, including with an error
+		std::unique_ptr<MovieRecorder> recorder;
+		if (record_filename) {
+			recorder.reset(new MovieRecorder(host, rom_filename, seed, clock_speed_hz));
+		}
+		Chip8Host& emu_host = recorder ? *(Chip8Host*)recorder.get() : host;
+		Chip8 emu(rom_filename, emu_host, seed);
+		emu.set_variant(variant);
+		emu.set_quirks(quirks);
+		if (recorder) {
+			recorder->attach(emu);
+		}
+		if (load_state_filename) {
+			emu.load_state_file(load_state_filename);
+		}
+		std::unique_ptr<Chip8Jit> jit;
+		if (use_jit) {
+			jit.reset(new Chip8Jit(emu, jit_lockstep));
+		}
+		std::unique_ptr<RewindBuffer> rewind;
+		if (rewind_seconds > 0) {
+			rewind.reset(new RewindBuffer(rewind_seconds * 60, (size_t)rewind_seconds * REWIND_BYTES_PER_SECOND));
+		}
 
-				TranslateMessage(&message);
-				DispatchMessage(&message);
-			}
+		// The sound goes to the speakers on Windows, and headless to a WAV file if one is given
+		AudioRing audio_ring;
+		Beeper beeper(audio_ring, AUDIO_SAMPLE_RATE, clock_speed_hz);
+		Beeper* active_beeper = nullptr;
+#ifdef _WIN32
+		// Fast-forwarded sound is sped up to play in real time, uncapped runs are muted
+		beeper.set_speed(uncapped ? 0 : fast_forward);
+		host.start_audio(audio_ring, beeper);
+		active_beeper = &beeper;
+#else
+		// Destroying the writer finishes the file, so it stays playable when the session ends with an error
+		std::unique_ptr<WavWriter> wav;
+		if (wav_filename) {
+			// A file isn't played while it is written, so it gets every sample in emulated time
+			wav.reset(new WavWriter(wav_filename, AUDIO_SAMPLE_RATE));
+			host.start_audio(audio_ring, beeper, *wav);
+			active_beeper = &beeper;
+		}
+#endif
 
-			// Execute number of interpreter instructions to simulate the relevant clock speed
-			// We also remember if any draw instructions were executed so we can update the screen
-			bool screen_dirty = false;
-			for (int i = 0; i < instructions_per_60hz; i++) {
-				emu.step();
-				if (emu.is_screen_dirty()) {
-					screen_dirty = true;
-					// A few websites say that the original interpreter blocked when drawing until
-					// the next vertical blank.
-					break;
+		auto start_time = std::chrono::steady_clock::now();
+		try {
+#ifdef _WIN32
+			// The window belongs to this thread, which shows the frames the emulation thread publishes,
+			// so a slow blit doesn't delay emulation. A fault is thrown here once both are done.
+			std::exception_ptr emulation_error;
+			std::thread emulation_thread([&] {
+				try {
+					run_emulator(emu, emu_host, scheduler, jit.get(), rewind.get(), recorder.get(), active_beeper,
+						frame_limit);
 				}
-			}
-
-			// If drawing instructions were run, we need to update the real window.
-			if (screen_dirty) {
-				screen_buffer buff = get_screen_buffer();
-				int pixel_width = buff.width / SCREEN_WIDTH;
-				int pixel_height = buff.height / SCREEN_HEIGHT;
-
-				for (int y = 0; y < SCREEN_HEIGHT; y++) {
-					for (int x = 0; x < SCREEN_WIDTH; x++) {
-						for (int py = 0; py < pixel_height; py++) {
-							for (int px = 0; px < pixel_width; px++) {
-								int screen_x = x * pixel_width + px;
-								int screen_y = y * pixel_height + py;
-								int* pixel = ((int*)buff.bitmap_memory) + screen_y * buff.width + screen_x;
-								int pixel_color;
-								if (emu.get_pixel_value(x, y)) {
-									pixel_color = 0x00FFFFFF;
-								} else {
-									pixel_color = 0x00000000;
-								}
-								*pixel = pixel_color;
-							}
-						}
-					}
+				catch (...) {
+					emulation_error = std::current_exception();
 				}
-				draw_to_screen();
+				host.stop_presenting();
+			});
+			host.run_presenter();
+			emulation_thread.join();
+			if (emulation_error) {
+				std::rethrow_exception(emulation_error);
 			}
-
-			// We check how much time we spent since the last time we got here, and sleep so we can
-			// essentially draw to screen at 60FPS.
-			LARGE_INTEGER cur_perf_count;
-			QueryPerformanceCounter(&cur_perf_count);
-			DWORD ms_elapsed = (1000 * (cur_perf_count.QuadPart - last_perf_count.QuadPart)) / perf_count_freq.QuadPart;
-			if (ms_elapsed < 16) {
-				Sleep(16 - ms_elapsed);
+#else
+			run_emulator(emu, emu_host, scheduler, jit.get(), rewind.get(), recorder.get(), active_beeper, frame_limit);
+#endif
+		}
+		catch (const std::runtime_error&) {
+			if (recorder) {
+				// The faulting frame is part of the movie, so replaying it ends with the same fault
+				recorder->end_frame();
+				recorder->finish().save(record_filename);
 			}
-			last_perf_count = cur_perf_count;
-			emu.step_clocks(); // Update internal clocks at 60HZ
+			throw;
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+		if (recorder) {
+			recorder->finish().save(record_filename);
+		}
+		if (save_state_filename) {
+			emu.save_state_file(save_state_filename);
 		}
+#ifdef CHIP8_PROFILE
+		save_profile(emu.get_profile());
+#endif
+
+#ifndef _WIN32
+		long long instructions_run = scheduler.get_emulated_instructions();
+		std::cout << "Ran " << scheduler.get_emulated_frames() << " frames (" << scheduler.get_emulated_seconds()
+			<< "s emulated, " << instructions_run << " instructions, " << host.get_frames_presented() << " presented, "
+			<< host.get_rows_presented() << " rows) in " << elapsed.count() << "s" << std::endl;
+		std::cout << emu.get_idle_cycle_count() << " instructions skipped waiting for the delay timer, seed "
+			<< emu.get_seed() << std::endl;
+		if (rewind) {
+			std::cout << rewind->get_frame_count() << " frames of rewind history in " << rewind->get_bytes_used()
+				<< " bytes" << std::endl;
+		}
+		if (wav) {
+			// The samples of the last frame are still in the ring
+			wav->drain(audio_ring);
+			wav->finish();
+			std::cout << wav->get_sample_count() << " samples of sound written, " << audio_ring.get_dropped_samples()
+				<< " dropped" << std::endl;
+		}
+		if (elapsed.count() > 0) {
+			std::cout << (instructions_run / elapsed.count()) << " instructions/s, "
+				<< (scheduler.get_emulated_seconds() / elapsed.count()) << "x realtime" << std::endl;
+		}
+#endif
 	}
 	catch (const std::runtime_error& err) {
 		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
 	}
 
-	timeEndPeriod(1);
-}
\ No newline at end of file
+	return 0;
+}
@@ -0,0 +1,287 @@
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "movie.h"
+#include "scheduler.h"
+
+#define MOVIE_FORMAT_VERSION 1
+
+void Movie::save(const char* filename) const {
+	std::ofstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to create movie file");
+	}
+
+	file << "chip8-movie " << MOVIE_FORMAT_VERSION << "\n";
+	file << "rom " << std::hex << rom_hash << std::dec << "\n";
+	file << "seed " << seed << "\n";
+	file << "hz " << instructions_per_second << "\n";
+	file << "variant " << Chip8::get_variant_name(variant) << "\n";
+	file << "quirks " << std::hex << quirks << std::dec << "\n";
+	file << "frames " << frames << "\n";
+	// Merge the two kinds of events in cycle order, which is also the order they happened in
+	size_t next_capture = 0;
+	for (size_t i = 0; i <= key_events.size(); i++) {
+		while (next_capture < capture_events.size()
+			&& (i == key_events.size() || capture_events[next_capture].cycle < key_events[i].cycle)) {
+			file << "capture " << capture_events[next_capture].cycle << " " << std::hex
+				<< capture_events[next_capture].key << std::dec << "\n";
+			next_capture++;
+		}
+		if (i < key_events.size()) {
+			file << "key " << key_events[i].cycle << " " << std::hex << key_events[i].key << std::dec << " "
+				<< (key_events[i].is_down ? "down" : "up") << "\n";
+		}
+	}
+	for (const MovieCheckpoint& checkpoint : checkpoints) {
+		file << "check " << checkpoint.frame << " " << std::hex << checkpoint.screen_hash << std::dec << "\n";
+	}
+
+	if (!file) {
+		throw std::runtime_error("Failed to write movie file");
+	}
+}
+
+Movie Movie::load(const char* filename) {
+	std::ifstream file(filename);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to open movie file");
+	}
+
+	std::string line;
+	int version = 0;
+	if (!std::getline(file, line) || !(std::istringstream(line) >> line >> version) || line != "chip8-movie"
+		|| version != MOVIE_FORMAT_VERSION) {
+		throw std::runtime_error("Not a movie of this version");
+	}
+
+	Movie movie;
+	while (std::getline(file, line)) {
+		if (line.empty()) {
+			continue;
+		}
+
+		std::istringstream fields(line);
+		std::string type;
+		fields >> type;
+		bool valid = false;
+		if (type == "rom") {
+			valid = !!(fields >> std::hex >> movie.rom_hash);
+		} else if (type == "seed") {
+			valid = !!(fields >> movie.seed);
+		} else if (type == "hz") {
+			valid = (fields >> movie.instructions_per_second) && movie.instructions_per_second > 0;
+		} else if (type == "variant") {
+			std::string name;
+			fields >> name;
+			for (int variant = 0; variant < VARIANT_COUNT; variant++) {
+				if (name == Chip8::get_variant_name((Chip8Variant)variant)) {
+					movie.variant = (Chip8Variant)variant;
+					valid = true;
+				}
+			}
+		} else if (type == "quirks") {
+			valid = (fields >> std::hex >> movie.quirks) && movie.quirks >= 0 && movie.quirks < CHIP8_QUIRK_SETS;
+		} else if (type == "frames") {
+			valid = (fields >> movie.frames) && movie.frames >= 0;
+		} else if (type == "key") {
+			MovieKeyEvent event;
+			std::string state;
+			valid = (fields >> event.cycle >> std::hex >> event.key >> state) && event.key >= 0 && event.key <= 0xF
+				&& (state == "down" || state == "up");
+			event.is_down = state == "down";
+			movie.key_events.push_back(event);
+		} else if (type == "capture") {
+			MovieCaptureEvent event;
+			valid = (fields >> event.cycle >> std::hex >> event.key) && event.key >= 0 && event.key <= 0xF;
+			movie.capture_events.push_back(event);
+		} else if (type == "check") {
+			MovieCheckpoint checkpoint;
+			valid = !!(fields >> checkpoint.frame >> std::hex >> checkpoint.screen_hash);
+			movie.checkpoints.push_back(checkpoint);
+		}
+		if (!valid) {
+			throw std::runtime_error("Invalid movie line: " + line);
+		}
+	}
+	return movie;
+}
+
+uint64_t hash_rom_file(const char* filename) {
+	std::ifstream file(filename, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to open rom file");
+	}
+	uint64_t hash = 14695981039346656037ull;
+	char c;
+	while (file.get(c)) {
+		hash ^= (byte)c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+MovieRecorder::MovieRecorder(Chip8Host& host, const char* rom_filename, uint64_t seed, int instructions_per_second)
+	: host(host) {
+	movie.rom_hash = hash_rom_file(rom_filename);
+	movie.seed = seed;
+	movie.instructions_per_second = instructions_per_second;
+}
+
+void MovieRecorder::attach(const Chip8& emu) {
+	this->emu = &emu;
+	movie.variant = emu.get_variant();
+	movie.quirks = emu.get_quirks();
+}
+
+void MovieRecorder::end_frame() {
+	movie.frames++;
+	if (movie.frames % MOVIE_CHECKPOINT_FRAMES == 0) {
+		movie.checkpoints.push_back({ movie.frames, emu->get_screen_hash() });
+	}
+}
+
+const Movie& MovieRecorder::finish() {
+	if (movie.checkpoints.empty() || movie.checkpoints.back().frame != movie.frames) {
+		movie.checkpoints.push_back({ movie.frames, emu->get_screen_hash() });
+	}
+	return movie;
+}
+
+bool MovieRecorder::is_key_down(int key_number) {
+	bool is_down = host.is_key_down(key_number);
+	// Only changes are stored, the replay keeps returning the last state of every key
+	if (is_down != key_states[key_number]) {
+		key_states[key_number] = is_down;
+		movie.key_events.push_back({ emu->get_cycle_count(), key_number, is_down });
+	}
+	return is_down;
+}
+
+void MovieRecorder::enable_key_capture() {
+	host.enable_key_capture();
+}
+
+int MovieRecorder::get_capture_key() {
+	int key_number = host.get_capture_key();
+	if (key_number != -1) {
+		movie.capture_events.push_back({ emu->get_cycle_count(), key_number });
+	}
+	return key_number;
+}
+
+bool MovieRecorder::process_events() {
+	return host.process_events();
+}
+
+void MovieRecorder::present(const Chip8& emu) {
+	host.present(emu);
+}
+
+void MovieRecorder::wait_until(std::chrono::steady_clock::time_point deadline) {
+	host.wait_until(deadline);
+}
+
+void MovieRecorder::wait_for_input(std::chrono::steady_clock::time_point deadline) {
+	host.wait_for_input(deadline);
+}
+
+bool MovieRecorder::is_rewinding() {
+	return host.is_rewinding();
+}
+
+void MovieRecorder::sound_changed(const Chip8& emu) {
+	host.sound_changed(emu);
+}
+
+// Answers the interpreter's questions about input from a movie
+class MovieReplayHost : public Chip8Host {
+	const Movie& movie;
+	const Chip8* emu = nullptr;
+	size_t next_key_event = 0;
+	size_t next_capture_event = 0;
+	bool key_states[16] = {};
+public:
+	MovieReplayHost(const Movie& movie) : movie(movie) {}
+
+	void attach(const Chip8& emu) {
+		this->emu = &emu;
+	}
+
+	bool is_key_down(int key_number) override {
+		long long cycle = emu->get_cycle_count();
+		while (next_key_event < movie.key_events.size() && movie.key_events[next_key_event].cycle <= cycle) {
+			key_states[movie.key_events[next_key_event].key] = movie.key_events[next_key_event].is_down;
+			next_key_event++;
+		}
+		return key_states[key_number];
+	}
+
+	void enable_key_capture() override {}
+
+	int get_capture_key() override {
+		if (next_capture_event < movie.capture_events.size()
+			&& movie.capture_events[next_capture_event].cycle <= emu->get_cycle_count()) {
+			return movie.capture_events[next_capture_event++].key;
+		}
+		return -1;
+	}
+
+	bool process_events() override { return true; }
+	void present(const Chip8& emu) override {}
+	void wait_until(std::chrono::steady_clock::time_point deadline) override {}
+};
+
+MovieReplayResult replay_movie(const char* rom_filename, const Movie& movie) {
+	if (hash_rom_file(rom_filename) != movie.rom_hash) {
+		throw std::runtime_error("The movie was recorded with a different rom");
+	}
+
+	MovieReplayResult result;
+	auto start_time = std::chrono::steady_clock::now();
+
+	MovieReplayHost host(movie);
+	Chip8 emu(rom_filename, host, movie.seed);
+	emu.set_variant(movie.variant);
+	emu.set_quirks(movie.quirks);
+	host.attach(emu);
+	Scheduler scheduler(movie.instructions_per_second);
+	scheduler.set_uncapped();
+
+	// The same frames the frontend runs, without presenting or waiting
+	size_t next_checkpoint = 0;
+	for (long long frame = 0; frame <= movie.frames; frame++) {
+		if (frame > 0) {
+			long long frame_start = emu.get_cycle_count();
+			if (emu.run(scheduler.begin_frame()) == STOP_FAULT) {
+				result.error = Chip8::get_trap_message(emu.get_trap());
+				break;
+			}
+			emu.step_clocks();
+			scheduler.end_frame(emu.get_cycle_count() - frame_start);
+			result.frames = frame;
+		}
+
+		while (next_checkpoint < movie.checkpoints.size() && movie.checkpoints[next_checkpoint].frame == frame) {
+			uint64_t hash = emu.get_screen_hash();
+			if (hash != movie.checkpoints[next_checkpoint].screen_hash) {
+				result.mismatch_frame = frame;
+				result.expected_hash = movie.checkpoints[next_checkpoint].screen_hash;
+				result.actual_hash = hash;
+				break;
+			}
+			result.checkpoints_passed++;
+			next_checkpoint++;
+		}
+		if (result.mismatch_frame != -1) {
+			break;
+		}
+	}
+
+	result.instructions = emu.get_cycle_count();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+	result.seconds = elapsed.count();
+	return result;
+}
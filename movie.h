@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+// A screen hash is stored every this many frames while recording
+#define MOVIE_CHECKPOINT_FRAMES 60
+
+// A key state change, as seen by is_key_down at the start of the instruction after cycle instructions
+struct MovieKeyEvent {
+	long long cycle;
+	int key;
+	bool is_down;
+};
+
+// A key returned by get_capture_key (for LD Vx, K)
+struct MovieCaptureEvent {
+	long long cycle;
+	int key;
+};
+
+// The hash of the screen after a frame
+struct MovieCheckpoint {
+	long long frame;
+	uint64_t screen_hash;
+};
+
+/*
+Everything needed to reproduce a session exactly: the rom, the RND seed, the instruction rate, and
+the input the interpreter saw, keyed by the emulated cycle it saw it at. Input is recorded at the
+interpreter's side of the host interface, so a replay doesn't depend on the timing of the original
+frontend at all. Movies are text files:
+	chip8-movie 1
+	rom HASH
+	seed SEED
+	hz INSTRUCTIONS_PER_SECOND
+	variant chip8|schip|xochip
+	quirks QUIRKS
+	frames FRAMES
+	key CYCLE KEY down|up
+	capture CYCLE KEY
+	check FRAME HASH
+with KEY, QUIRKS (CHIP8_QUIRK_* bits) and hashes in hex, and the events in cycle order. Movies without
+a variant and quirks are of the default variant, with no quirks.
+*/
+struct Movie {
+	uint64_t rom_hash = 0;
+	uint64_t seed = 0;
+	int instructions_per_second = 540;
+	Chip8Variant variant = VARIANT_CHIP8;
+	int quirks = 0;
+	long long frames = 0;
+	std::vector<MovieKeyEvent> key_events;
+	std::vector<MovieCaptureEvent> capture_events;
+	std::vector<MovieCheckpoint> checkpoints;
+
+	// Both throw std::runtime_error on errors
+	void save(const char* filename) const;
+	static Movie load(const char* filename);
+};
+
+// FNV-1a of a rom file, to check that a movie is replayed with the rom it was recorded with
+uint64_t hash_rom_file(const char* filename);
+
+/*
+Records a movie of a session while passing everything through to the real host. The interpreter
+must be created with the recorder as its host, and attached before it runs.
+*/
+class MovieRecorder : public Chip8Host {
+	Chip8Host& host;
+	const Chip8* emu = nullptr;
+	Movie movie;
+	bool key_states[16] = {};
+public:
+	MovieRecorder(Chip8Host& host, const char* rom_filename, uint64_t seed, int instructions_per_second);
+
+	// Also records the variant and quirks of the interpreter, so set them first
+	void attach(const Chip8& emu);
+	// Call after every frame (after step_clocks), to count frames and add checkpoints
+	void end_frame();
+	// The movie up to now, ending with a checkpoint of the current screen
+	const Movie& finish();
+
+	bool is_key_down(int key_number) override;
+	void enable_key_capture() override;
+	int get_capture_key() override;
+
+	bool process_events() override;
+	void present(const Chip8& emu) override;
+	void wait_until(std::chrono::steady_clock::time_point deadline) override;
+	void wait_for_input(std::chrono::steady_clock::time_point deadline) override;
+	bool is_rewinding() override;
+	void sound_changed(const Chip8& emu) override;
+};
+
+struct MovieReplayResult {
+	long long frames = 0;
+	long long instructions = 0;
+	int checkpoints_passed = 0;
+	// The frame of the first checkpoint with a different screen, or -1 if they all matched
+	long long mismatch_frame = -1;
+	uint64_t expected_hash = 0;
+	uint64_t actual_hash = 0;
+	// Set if the interpreter faulted
+	std::string error;
+	double seconds = 0;
+
+	bool is_ok() const { return mismatch_frame == -1 && error.empty(); }
+};
+
+// Replay a movie headless as fast as possible, stopping at the first checkpoint that doesn't match.
+// Throws std::runtime_error if the rom isn't the one the movie was recorded with.
+MovieReplayResult replay_movie(const char* rom_filename, const Movie& movie);
@@ -0,0 +1,170 @@
+#include "rewind.h"
+
+// A literal run ends at this many unchanged bytes, shorter gaps are cheaper to copy than to encode
+#define REWIND_MIN_ZERO_RUN 8
+
+RewindBuffer::RewindBuffer(int max_frames, size_t max_bytes) {
+	data.resize(max_bytes);
+	records.resize(std::max(max_frames, 1));
+	// Every literal run is at least one byte plus its 8 byte header, and followed by at least
+	// REWIND_MIN_ZERO_RUN unchanged bytes, so the encoding never gets much bigger than the state.
+	scratch.resize(2 * sizeof(Chip8Savestate) + 8);
+}
+
+// Run lengths are 32 bits, runs of unchanged memory can be longer than 64KB
+static inline void write_u32(byte* out, size_t value) {
+	out[0] = value & 0xFF;
+	out[1] = (value >> 8) & 0xFF;
+	out[2] = (value >> 16) & 0xFF;
+	out[3] = (value >> 24) & 0xFF;
+}
+
+static inline size_t read_u32(const byte* in) {
+	return in[0] | (in[1] << 8) | (in[2] << 16) | ((size_t)in[3] << 24);
+}
+
+size_t RewindBuffer::encode_difference(const byte* a, const byte* b, size_t size, byte* out) {
+	// A list of (unchanged byte count, changed byte count, changed bytes XORed) runs. Unchanged
+	// bytes at the end are left out.
+	size_t out_size = 0;
+	size_t i = 0;
+	while (i < size) {
+		size_t zero_start = i;
+		while (i + 8 <= size) {
+			uint64_t word_a, word_b;
+			std::memcpy(&word_a, a + i, 8);
+			std::memcpy(&word_b, b + i, 8);
+			if (word_a != word_b) {
+				break;
+			}
+			i += 8;
+		}
+		while (i < size && a[i] == b[i]) {
+			i++;
+		}
+		if (i == size) {
+			break;
+		}
+
+		size_t literal_start = i;
+		size_t literal_end = size;
+		int equal_run = 0;
+		for (; i < size; i++) {
+			if (a[i] != b[i]) {
+				equal_run = 0;
+			} else if (++equal_run == REWIND_MIN_ZERO_RUN) {
+				literal_end = i + 1 - REWIND_MIN_ZERO_RUN;
+				break;
+			}
+		}
+		i = literal_end;
+
+		write_u32(out + out_size, literal_start - zero_start);
+		write_u32(out + out_size + 4, literal_end - literal_start);
+		out_size += 8;
+		for (size_t j = literal_start; j < literal_end; j++) {
+			out[out_size++] = a[j] ^ b[j];
+		}
+	}
+	return out_size;
+}
+
+void RewindBuffer::apply_difference(const byte* encoded, size_t encoded_size, byte* state) {
+	size_t pos = 0;
+	size_t offset = 0;
+	while (pos < encoded_size) {
+		offset += read_u32(encoded + pos);
+		size_t literal_size = read_u32(encoded + pos + 4);
+		pos += 8;
+		for (size_t i = 0; i < literal_size; i++) {
+			state[offset + i] ^= encoded[pos + i];
+		}
+		pos += literal_size;
+		offset += literal_size;
+	}
+}
+
+void RewindBuffer::push(const Chip8& emu) {
+	size_t current_size = emu.save_state(current);
+	if (!has_latest || current_size != latest_size) {
+		// Differences are between savestates of the same size, a different variant starts over
+		clear();
+		std::memcpy(&latest, &current, current_size);
+		latest_size = current_size;
+		has_latest = true;
+		return;
+	}
+
+	size_t size = encode_difference((const byte*)&latest, (const byte*)&current, current_size, scratch.data());
+	std::memcpy(&latest, &current, current_size);
+	if (size > data.size()) {
+		// Doesn't fit even in an empty buffer, so the history before this frame is lost
+		while (record_count) {
+			drop_oldest();
+		}
+		return;
+	}
+
+	if (record_count == (int)records.size()) {
+		drop_oldest();
+	}
+	if (record_count == 0) {
+		first_record = 0;
+		write_offset = 0;
+	}
+	if (write_offset + size > data.size()) {
+		// The end of the buffer is too small, so it is left unused (dropping the old records in it) and
+		// we continue at the start
+		while (record_count && records[first_record].offset >= write_offset) {
+			drop_oldest();
+		}
+		write_offset = 0;
+	}
+	while (record_count && records[first_record].offset < write_offset + size
+		&& write_offset < records[first_record].offset + records[first_record].size) {
+		drop_oldest();
+	}
+
+	std::memcpy(&data[write_offset], scratch.data(), size);
+	records[(first_record + record_count) % records.size()] = { write_offset, size };
+	record_count++;
+	write_offset += size;
+	bytes_used += size;
+}
+
+bool RewindBuffer::step_back(Chip8& emu) {
+	if (!record_count) {
+		return false;
+	}
+
+	const Record& newest = records[(first_record + record_count - 1) % records.size()];
+	apply_difference(&data[newest.offset], newest.size, (byte*)&latest);
+	record_count--;
+	bytes_used -= newest.size;
+	write_offset = newest.offset;
+
+	emu.load_state(&latest, latest_size);
+	return true;
+}
+
+void RewindBuffer::clear() {
+	first_record = 0;
+	record_count = 0;
+	write_offset = 0;
+	bytes_used = 0;
+	has_latest = false;
+}
+
+int RewindBuffer::get_frame_count() const {
+	return record_count;
+}
+
+size_t RewindBuffer::get_bytes_used() const {
+	return bytes_used;
+}
+
+void RewindBuffer::drop_oldest() {
+	bytes_used -= records[first_record].size;
+	first_record = (first_record + 1) % records.size();
+	record_count--;
+}
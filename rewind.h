@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "chip8.h"
+
+/*
+Keeps the last frames of a session so it can be played backwards.
+
+Every push stores the difference between the new savestate and the previous one: the two are
+XORed and the result, which is almost all zeros, is run-length encoded. Since XOR is its own
+inverse, applying the newest difference to the newest state gives the state before it, so going
+back one frame is a single decode pass. Differences are stored back to back in a fixed byte ring,
+and the oldest ones are dropped when it fills up, so memory use never grows past the limits given
+to the constructor.
+*/
+class RewindBuffer {
+	struct Record {
+		size_t offset;
+		size_t size;
+	};
+
+	// Encoded differences, oldest first, in a circular list of at most max_frames records
+	std::vector<byte> data;
+	std::vector<Record> records;
+	int first_record = 0;
+	int record_count = 0;
+	size_t write_offset = 0;
+	size_t bytes_used = 0;
+
+	// The state of the newest frame, and the one being captured. Only the first latest_size bytes are
+	// compared, which leaves out the memory a variant doesn't have.
+	Chip8Savestate latest;
+	Chip8Savestate current;
+	size_t latest_size = 0;
+	bool has_latest = false;
+	// Scratch space for encoding, the worst case size of one difference
+	std::vector<byte> scratch;
+public:
+	// Keep up to max_frames frames of history in at most max_bytes of differences
+	RewindBuffer(int max_frames, size_t max_bytes);
+
+	// Record the state at the end of a frame
+	void push(const Chip8& emu);
+	// Restore the state of the frame before the newest one and make it the newest. Returns false
+	// when there is no older frame left.
+	bool step_back(Chip8& emu);
+	void clear();
+
+	// How many times step_back can be called
+	int get_frame_count() const;
+	size_t get_bytes_used() const;
+private:
+	void drop_oldest();
+	// Run-length encode a XOR b into out, returns the encoded size
+	static size_t encode_difference(const byte* a, const byte* b, size_t size, byte* out);
+	// XOR an encoded difference into state
+	static void apply_difference(const byte* encoded, size_t encoded_size, byte* state);
+};
@@ -0,0 +1,141 @@
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SCALER_USE_SSE2 1
+#endif
+
+#include "scaler.h"
+
+// Halve every channel of a color
+static uint32_t dim_color(uint32_t color) {
+	return (color >> 1) & 0x007F7F7F;
+}
+
+static void fill_lut(std::vector<uint32_t>& lut, int scale_x, uint32_t off_color, uint32_t on_color) {
+	lut.resize(256 * 8 * scale_x);
+	for (int value = 0; value < 256; value++) {
+		uint32_t* pixels = &lut[value * 8 * scale_x];
+		for (int bit = 0; bit < 8; bit++) {
+			uint32_t color = ((value >> (7 - bit)) & 1) ? on_color : off_color;
+			for (int i = 0; i < scale_x; i++) {
+				*pixels++ = color;
+			}
+		}
+	}
+}
+
+static void fill_plane_lut(std::vector<uint32_t>& lut, int scale_x, const uint32_t colors[4]) {
+	lut.resize(256 * 4 * scale_x);
+	for (int value = 0; value < 256; value++) {
+		uint32_t* pixels = &lut[value * 4 * scale_x];
+		for (int bit = 0; bit < 4; bit++) {
+			int first = (value >> (3 - bit)) & 1;
+			int second = (value >> (7 - bit)) & 1;
+			for (int i = 0; i < scale_x; i++) {
+				*pixels++ = colors[first | (second << 1)];
+			}
+		}
+	}
+}
+
+static void copy_pixels(uint32_t* dst, const uint32_t* src, int count) {
+	int i = 0;
+#ifdef SCALER_USE_SSE2
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+	}
+#endif
+	for (; i < count; i++) {
+		dst[i] = src[i];
+	}
+}
+
+Scaler::Scaler(int scale_x, int scale_y, uint32_t off_color, uint32_t on_color, ScaleMode mode)
+	: scale_x(scale_x), scale_y(scale_y), mode(mode), off_color(off_color), on_color(on_color) {
+	fill_lut(byte_lut, scale_x, off_color, on_color);
+	fill_lut(dim_byte_lut, scale_x, dim_color(off_color), dim_color(on_color));
+	set_plane_colors(dim_color(on_color), dim_color(on_color) + dim_color(dim_color(on_color)));
+}
+
+void Scaler::set_plane_colors(uint32_t second_color, uint32_t both_color) {
+	uint32_t colors[4] = { off_color, on_color, second_color, both_color };
+	fill_plane_lut(plane_lut, scale_x, colors);
+	for (uint32_t& color : colors) {
+		color = dim_color(color);
+	}
+	fill_plane_lut(dim_plane_lut, scale_x, colors);
+}
+
+void Scaler::scale(const uint64_t* rows, int width, int height, uint64_t row_mask, uint32_t* out, int out_pitch) const {
+	int words_per_row = width / 64;
+	int byte_pixels = 8 * scale_x;
+	int line_pixels = width * scale_x;
+	bool scanlines = (mode == SCALE_SCANLINES) && scale_y > 1;
+
+	for (int y = 0; y < height; y++) {
+		if (!((row_mask >> y) & 1)) {
+			continue;
+		}
+
+		// Expand the first output line from the lookup table, 8 pixels at a time
+		uint32_t* line = out + y * scale_y * out_pitch;
+		for (int word = 0; word < words_per_row; word++) {
+			uint64_t pixels = rows[y * words_per_row + word];
+			for (int i = 0; i < 8; i++) {
+				int value = (pixels >> (56 - 8 * i)) & 0xFF;
+				memcpy(line + (word * 8 + i) * byte_pixels, &byte_lut[value * byte_pixels], byte_pixels * sizeof(uint32_t));
+			}
+		}
+
+		// The other output lines of the row are copies of it
+		int copies = scanlines ? scale_y - 2 : scale_y - 1;
+		for (int i = 1; i <= copies; i++) {
+			copy_pixels(line + i * out_pitch, line, line_pixels);
+		}
+
+		if (scanlines) {
+			uint32_t* dim_line = line + (scale_y - 1) * out_pitch;
+			for (int word = 0; word < words_per_row; word++) {
+				uint64_t pixels = rows[y * words_per_row + word];
+				for (int i = 0; i < 8; i++) {
+					int value = (pixels >> (56 - 8 * i)) & 0xFF;
+					memcpy(dim_line + (word * 8 + i) * byte_pixels, &dim_byte_lut[value * byte_pixels], byte_pixels * sizeof(uint32_t));
+				}
+			}
+		}
+	}
+}
+
+void Scaler::scale_planes(const uint64_t* first_rows, const uint64_t* second_rows, int width, int height,
+	uint64_t row_mask, uint32_t* out, int out_pitch) const {
+	int words_per_row = width / 64;
+	int nibble_pixels = 4 * scale_x;
+	int line_pixels = width * scale_x;
+	bool scanlines = (mode == SCALE_SCANLINES) && scale_y > 1;
+
+	for (int y = 0; y < height; y++) {
+		if (!((row_mask >> y) & 1)) {
+			continue;
+		}
+
+		uint32_t* line = out + y * scale_y * out_pitch;
+		uint32_t* dim_line = line + (scale_y - 1) * out_pitch;
+		for (int word = 0; word < words_per_row; word++) {
+			uint64_t first = first_rows[y * words_per_row + word];
+			uint64_t second = second_rows[y * words_per_row + word];
+			for (int i = 0; i < 16; i++) {
+				int value = ((first >> (60 - 4 * i)) & 0xF) | (((second >> (60 - 4 * i)) & 0xF) << 4);
+				int offset = (word * 16 + i) * nibble_pixels;
+				memcpy(line + offset, &plane_lut[value * nibble_pixels], nibble_pixels * sizeof(uint32_t));
+				if (scanlines) {
+					memcpy(dim_line + offset, &dim_plane_lut[value * nibble_pixels], nibble_pixels * sizeof(uint32_t));
+				}
+			}
+		}
+
+		int copies = scanlines ? scale_y - 2 : scale_y - 1;
+		for (int i = 1; i <= copies; i++) {
+			copy_pixels(line + i * out_pitch, line, line_pixels);
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+enum ScaleMode {
+	// Every CHIP-8 pixel becomes a solid block
+	SCALE_NEAREST,
+	// The bottom line of every block is darkened, like the gaps between CRT scanlines
+	SCALE_SCANLINES,
+};
+
+/*
+Expands the packed screen (one bit per pixel, most significant bit first) into 32-bit pixels at an
+integer scale. Each byte of a row is expanded with a lookup table holding the scaled-up colors of
+all 256 bit patterns, and the first output line of a row is then copied to the others.
+
+Two planes (XO-CHIP) are expanded 4 pixels at a time, from a table indexed by a nibble of each
+plane, into the four colors of set_plane_colors.
+*/
+class Scaler {
+	int scale_x;
+	int scale_y;
+	ScaleMode mode;
+	uint32_t off_color;
+	uint32_t on_color;
+	// For every byte value, the 8 * scale_x output pixels it expands to
+	std::vector<uint32_t> byte_lut;
+	// The same, with darkened colors for scanlines
+	std::vector<uint32_t> dim_byte_lut;
+	// For every pair of nibbles (first plane in the low nibble), the 4 * scale_x output pixels
+	std::vector<uint32_t> plane_lut;
+	std::vector<uint32_t> dim_plane_lut;
+public:
+	Scaler(int scale_x, int scale_y, uint32_t off_color, uint32_t on_color, ScaleMode mode = SCALE_NEAREST);
+
+	// Scale the rows of the screen that are set in row_mask (bit y is row y). The screen has width
+	// pixels per row, packed into width / 64 words. out_pitch is the distance between output lines,
+	// in pixels.
+	void scale(const uint64_t* rows, int width, int height, uint64_t row_mask, uint32_t* out, int out_pitch) const;
+	// The colors of pixels that are only on in the second plane, and on in both. By default they are
+	// the on color at half and three quarters of its brightness.
+	void set_plane_colors(uint32_t second_color, uint32_t both_color);
+	// Like scale, with the color of every pixel picked by both planes
+	void scale_planes(const uint64_t* first_rows, const uint64_t* second_rows, int width, int height,
+		uint64_t row_mask, uint32_t* out, int out_pitch) const;
+};
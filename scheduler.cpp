@@ -0,0 +1,86 @@
+#include "scheduler.h"
+
+// One 60Hz frame
+static const std::chrono::steady_clock::duration frame_duration =
+	std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / 60));
+
+Scheduler::Scheduler(int instructions_per_second) : instructions_per_second(instructions_per_second) {
+	next_present_time = clock::now();
+}
+
+void Scheduler::set_instruction_rate(int instructions_per_second) {
+	this->instructions_per_second = instructions_per_second;
+	instruction_remainder = 0;
+}
+
+int Scheduler::get_instruction_rate() const {
+	return instructions_per_second;
+}
+
+void Scheduler::set_realtime() {
+	speed_mode = SPEED_REALTIME;
+	fast_forward_factor = 1;
+	next_present_time = clock::now();
+}
+
+void Scheduler::set_fast_forward(int factor) {
+	speed_mode = SPEED_FAST_FORWARD;
+	fast_forward_factor = (factor > 1) ? factor : 1;
+	next_present_time = clock::now();
+}
+
+void Scheduler::set_uncapped() {
+	speed_mode = SPEED_UNCAPPED;
+	next_present_time = clock::now();
+}
+
+SpeedMode Scheduler::get_speed_mode() const {
+	return speed_mode;
+}
+
+int Scheduler::begin_frame() {
+	instruction_remainder += instructions_per_second;
+	int instructions = instruction_remainder / 60;
+	instruction_remainder %= 60;
+	return instructions;
+}
+
+bool Scheduler::end_frame(int instructions_run) {
+	emulated_frames++;
+	emulated_instructions += instructions_run;
+
+	switch (speed_mode) {
+	case SPEED_REALTIME:
+		return true;
+	case SPEED_FAST_FORWARD:
+		return emulated_frames % fast_forward_factor == 0;
+	default:
+		return clock::now() >= next_present_time;
+	}
+}
+
+std::chrono::steady_clock::time_point Scheduler::present_done() {
+	clock::time_point now = clock::now();
+	next_present_time += frame_duration;
+	// If we fell more than a frame behind (slow host, debugger, ...) we don't try to catch up.
+	if (next_present_time + frame_duration < now) {
+		next_present_time = now;
+	}
+
+	if (speed_mode == SPEED_UNCAPPED) {
+		return now;
+	}
+	return next_present_time;
+}
+
+long long Scheduler::get_emulated_frames() const {
+	return emulated_frames;
+}
+
+long long Scheduler::get_emulated_instructions() const {
+	return emulated_instructions;
+}
+
+double Scheduler::get_emulated_seconds() const {
+	return emulated_frames / 60.0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+
+enum SpeedMode {
+	// One emulated frame per 60Hz frame of wall time
+	SPEED_REALTIME,
+	// A fixed number of emulated frames per 60Hz frame of wall time
+	SPEED_FAST_FORWARD,
+	// As many emulated frames as the host can run, presenting about 60 times a second
+	SPEED_UNCAPPED,
+};
+
+/*
+Keeps emulated time separate from wall time. Emulated time advances in 60Hz frames, each running
+the number of instructions that the instruction rate allows and ticking the timers once, no matter
+how fast the frames actually run. The speed mode only decides how often the frontend presents and
+how long it waits between presents.
+*/
+class Scheduler {
+	typedef std::chrono::steady_clock clock;
+
+	int instructions_per_second;
+	// Instructions per second that didn't add up to a whole instruction in a frame yet
+	int instruction_remainder = 0;
+	SpeedMode speed_mode = SPEED_REALTIME;
+	int fast_forward_factor = 1;
+
+	long long emulated_frames = 0;
+	long long emulated_instructions = 0;
+	clock::time_point next_present_time;
+public:
+	Scheduler(int instructions_per_second);
+
+	void set_instruction_rate(int instructions_per_second);
+	int get_instruction_rate() const;
+
+	void set_realtime();
+	void set_fast_forward(int factor);
+	void set_uncapped();
+	SpeedMode get_speed_mode() const;
+
+	// Returns how many instructions the next emulated frame runs. Rates that aren't a multiple of 60
+	// are spread over the frames, so every second of emulated time runs exactly the instruction rate.
+	int begin_frame();
+	// Call after running an emulated frame and ticking the timers. Returns whether the frontend
+	// should present now.
+	bool end_frame(int instructions_run);
+	// Call after presenting. Returns when the next frame should start.
+	clock::time_point present_done();
+
+	long long get_emulated_frames() const;
+	long long get_emulated_instructions() const;
+	double get_emulated_seconds() const;
+};
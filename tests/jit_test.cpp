@@ -0,0 +1,190 @@
+/*
+Regression tests for the recompiler. Build from the repository root with:
+	g++ -std=c++17 -O2 -I. -o chip8_jit_test tests/jit_test.cpp chip8.cpp chip8_jit.cpp
+Every test runs a ROM with the recompiler and with the interpreter and compares the savestates.
+Prints the tests that fail and exits with 1 if there are any.
+*/
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "chip8.h"
+#include "chip8_jit.h"
+
+// Host that never presses keys and never waits
+class TestHost : public Chip8Host {
+public:
+	bool is_key_down(int key_number) override { return false; }
+	void enable_key_capture() override {}
+	int get_capture_key() override { return -1; }
+
+	bool process_events() override { return true; }
+	void present(const Chip8& emu) override {}
+	void wait_until(std::chrono::steady_clock::time_point deadline) override {}
+};
+
+// Place instructions at an address of a ROM, which is grown to fit them
+static void put(std::vector<byte>& rom, int addr, const std::vector<unsigned short>& program) {
+	for (unsigned short instr : program) {
+		int offset = addr - 0x200;
+		if ((int)rom.size() < offset + 2) {
+			rom.resize(offset + 2);
+		}
+		rom[offset] = (instr >> 8) & 0xFF;
+		rom[offset + 1] = instr & 0xFF;
+		addr += 2;
+	}
+}
+
+static bool same_state(const Chip8& a, const Chip8& b) {
+	std::unique_ptr<Chip8Savestate> state_a(new Chip8Savestate);
+	std::unique_ptr<Chip8Savestate> state_b(new Chip8Savestate);
+	size_t size = a.save_state(*state_a);
+	return b.save_state(*state_b) == size && memcmp(state_a.get(), state_b.get(), size) == 0;
+}
+
+// Blocks of 8xy5, the largest instruction, starting at every address, so the code buffer fills up
+// and is flushed many times. Blocks must end before running past the end of the buffer.
+static bool test_code_buffer_full(TestHost& host) {
+	std::vector<byte> rom;
+	put(rom, 0x200, { 0xB300 }); // JP V0, 0x300
+	for (int addr = 0x300; addr < 0xB00; addr += 2) {
+		put(rom, addr, { 0x8125 }); // SUB V1, V2
+	}
+	put(rom, 0xB00, {
+		0x7002, // ADD V0, 2
+		0x1200, // JP 0x200
+	});
+
+	Chip8 emu(rom.data(), rom.size(), host);
+	Chip8 reference(rom.data(), rom.size(), host);
+	Chip8Jit jit(emu, true);
+	jit.run(2000000);
+	reference.run(2000000);
+	return same_state(emu, reference);
+}
+
+// A loop that compiles to a single block of 62 instructions, run 9 instructions per frame like at
+// 540Hz. Every frame has to stop inside the block where the interpreter stops.
+static bool test_cycle_budget(TestHost& host) {
+	std::vector<byte> rom;
+	for (int i = 0; i < 60; i++) {
+		put(rom, 0x200 + i * 2, { 0x7301 }); // ADD V3, 1
+	}
+	put(rom, 0x278, {
+		0x7101, // ADD V1, 1
+		0x1200, // JP 0x200
+	});
+
+	Chip8 emu(rom.data(), rom.size(), host);
+	Chip8 reference(rom.data(), rom.size(), host);
+	Chip8Jit jit(emu, true);
+	for (int frame = 0; frame < 600; frame++) {
+		jit.run(9);
+		reference.run(9);
+		emu.step_clocks();
+		reference.step_clocks();
+		if (!same_state(emu, reference)) {
+			return false;
+		}
+	}
+	return emu.get_cycle_count() == 5400;
+}
+
+// XO-CHIP skips skip the 4 bytes of F000 nnnn. A store rewrites the instruction after a compiled
+// skip into F000 nnnn, which has to throw the block away so the skip lands after it.
+static bool test_skip_over_rewritten_long_load(TestHost& host) {
+	std::vector<byte> rom;
+	put(rom, 0x200, {
+		0x7201, // ADD V2, 1
+		0x3500, // SE V5, 0
+		0x6105, // LD V1, 5 (becomes F000 7301, LD I, 0x7301)
+		0x7301, // ADD V3, 1
+		0x60F0, // LD V0, 0xF0
+		0x6100, // LD V1, 0
+		0xA204, // LD I, 0x204
+		0xF155, // LD [I], V1
+		0x1200, // JP 0x200
+	});
+
+	Chip8 emu(rom.data(), rom.size(), host);
+	Chip8 reference(rom.data(), rom.size(), host);
+	emu.set_variant(VARIANT_XOCHIP);
+	reference.set_variant(VARIANT_XOCHIP);
+	Chip8Jit jit(emu);
+	for (int frame = 0; frame < 20; frame++) {
+		jit.run(9);
+		reference.run(9);
+		if (!same_state(emu, reference)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// A loop waiting for the delay timer, which the interpreter skips to the end of every frame. The
+// recompiler has to skip the same instructions and return the same stop reasons.
+static bool test_timer_wait_loop(TestHost& host) {
+	std::vector<byte> rom;
+	put(rom, 0x200, {
+		0x6005, // LD V0, 5
+		0xF015, // LD DT, V0
+		0xF007, // LD V0, DT
+		0x3000, // SE V0, 0
+		0x1204, // JP 0x204
+		0x7101, // ADD V1, 1
+		0x1200, // JP 0x200
+	});
+
+	Chip8 emu(rom.data(), rom.size(), host);
+	Chip8 reference(rom.data(), rom.size(), host);
+	Chip8Jit jit(emu, true);
+	for (int frame = 0; frame < 120; frame++) {
+		Chip8StopReason reason = jit.run(20);
+		if (reason != reference.run(20)) {
+			return false;
+		}
+		emu.step_clocks();
+		reference.step_clocks();
+		if (!same_state(emu, reference)) {
+			return false;
+		}
+	}
+	return emu.get_idle_cycle_count() > 0;
+}
+
+int main() {
+	TestHost host;
+	struct {
+		const char* name;
+		bool (*run)(TestHost& host);
+	} tests[] = {
+		{ "code buffer full", test_code_buffer_full },
+		{ "cycle budget", test_cycle_budget },
+		{ "skip over rewritten long load", test_skip_over_rewritten_long_load },
+		{ "timer wait loop", test_timer_wait_loop },
+	};
+
+	int failures = 0;
+	for (const auto& test : tests) {
+		bool passed;
+		try {
+			passed = test.run(host);
+		}
+		catch (const std::runtime_error& e) {
+			std::cout << test.name << ": " << e.what() << std::endl;
+			passed = false;
+		}
+		if (!passed) {
+			std::cout << "FAILED: " << test.name << std::endl;
+			failures++;
+		}
+	}
+	std::cout << (sizeof(tests) / sizeof(tests[0]) - failures) << " of " << (sizeof(tests) / sizeof(tests[0]))
+		<< " tests passed" << std::endl;
+	return failures ? 1 : 0;
+}
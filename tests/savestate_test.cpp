@@ -0,0 +1,145 @@
+/*
+Savestate regression tests. Build from the repository root with:
+	g++ -std=c++17 -O2 -I. -o chip8_savestate_test tests/savestate_test.cpp chip8.cpp
+Every test saves a machine, restores the savestate into another one and runs both side by side.
+Prints the tests that fail and exits with 1 if there are any.
+*/
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "chip8.h"
+
+// Host that never presses keys and never waits
+class TestHost : public Chip8Host {
+public:
+	bool is_key_down(int key_number) override { return false; }
+	void enable_key_capture() override {}
+	int get_capture_key() override { return -1; }
+
+	bool process_events() override { return true; }
+	void present(const Chip8& emu) override {}
+	void wait_until(std::chrono::steady_clock::time_point deadline) override {}
+};
+
+static std::vector<byte> make_rom(const std::vector<unsigned short>& program) {
+	std::vector<byte> rom;
+	for (unsigned short instr : program) {
+		rom.push_back((instr >> 8) & 0xFF);
+		rom.push_back(instr & 0xFF);
+	}
+	return rom;
+}
+
+// Loading a savestate marks every row dirty, so the dirty rows are cleared before comparing
+static bool same_state(Chip8& a, Chip8& b) {
+	a.clear_dirty_rows();
+	b.clear_dirty_rows();
+	std::unique_ptr<Chip8Savestate> state_a(new Chip8Savestate);
+	std::unique_ptr<Chip8Savestate> state_b(new Chip8Savestate);
+	size_t size = a.save_state(*state_a);
+	return b.save_state(*state_b) == size && memcmp(state_a.get(), state_b.get(), size) == 0;
+}
+
+// Stores to and loads from memory above 4KB with the long XO-CHIP LD I, addr
+static std::vector<byte> xochip_rom() {
+	return make_rom({
+		0x60AB, // LD V0, 0xAB
+		0xF000, 0xE000, // LD I, 0xE000
+		0xF055, // LD [I], V0
+		0xF000, 0xE000, // LD I, 0xE000
+		0xF165, // LD V1, [I]
+		0x7201, // ADD V2, 1
+		0x1208, // JP 0x208
+	});
+}
+
+// An XO-CHIP savestate restored through the savestate constructor, which starts out as CHIP-8
+static bool test_xochip_constructor(TestHost& host) {
+	std::vector<byte> rom = xochip_rom();
+	Chip8 emu(rom.data(), rom.size(), host);
+	emu.set_variant(VARIANT_XOCHIP);
+	emu.set_quirks(CHIP8_QUIRK_SHIFT_VY);
+	emu.run(3);
+
+	std::unique_ptr<Chip8Savestate> savestate(new Chip8Savestate);
+	emu.save_state(*savestate);
+	Chip8 restored(*savestate, host);
+	if (restored.get_variant() != VARIANT_XOCHIP || restored.get_quirks() != CHIP8_QUIRK_SHIFT_VY
+		|| restored.get_savestate_size() != emu.get_savestate_size()) {
+		return false;
+	}
+
+	if (emu.run(1000) == STOP_FAULT || restored.run(1000) == STOP_FAULT) {
+		return false;
+	}
+	return same_state(emu, restored);
+}
+
+// Savestates of either size loaded into a machine of the other variant
+static bool test_variant_switch(TestHost& host) {
+	std::vector<byte> rom = xochip_rom();
+	Chip8 xochip(rom.data(), rom.size(), host);
+	xochip.set_variant(VARIANT_XOCHIP);
+	xochip.run(3);
+	std::vector<byte> chip8_rom = make_rom({ 0x7001, 0x1200 });
+	Chip8 chip8(chip8_rom.data(), chip8_rom.size(), host);
+	chip8.run(5);
+
+	std::unique_ptr<Chip8Savestate> xochip_state(new Chip8Savestate);
+	std::unique_ptr<Chip8Savestate> chip8_state(new Chip8Savestate);
+	xochip.save_state(*xochip_state);
+	chip8.save_state(*chip8_state);
+
+	Chip8 machine(chip8_rom.data(), chip8_rom.size(), host);
+	machine.load_state(*xochip_state);
+	if (machine.get_variant() != VARIANT_XOCHIP || machine.run(1000) == STOP_FAULT) {
+		return false;
+	}
+	xochip.run(1000);
+	if (!same_state(machine, xochip)) {
+		return false;
+	}
+
+	machine.load_state(*chip8_state);
+	if (machine.get_variant() != VARIANT_CHIP8 || machine.get_quirks() != chip8.get_quirks()) {
+		return false;
+	}
+	machine.run(1000);
+	chip8.run(1000);
+	return same_state(machine, chip8);
+}
+
+int main() {
+	TestHost host;
+	struct {
+		const char* name;
+		bool (*run)(TestHost& host);
+	} tests[] = {
+		{ "xochip constructor", test_xochip_constructor },
+		{ "variant switch", test_variant_switch },
+	};
+
+	int failures = 0;
+	for (const auto& test : tests) {
+		bool passed;
+		try {
+			passed = test.run(host);
+		}
+		catch (const std::runtime_error& e) {
+			std::cout << test.name << ": " << e.what() << std::endl;
+			passed = false;
+		}
+		if (!passed) {
+			std::cout << "FAILED: " << test.name << std::endl;
+			failures++;
+		}
+	}
+	std::cout << (sizeof(tests) / sizeof(tests[0]) - failures) << " of " << (sizeof(tests) / sizeof(tests[0]))
+		<< " tests passed" << std::endl;
+	return failures ? 1 : 0;
+}
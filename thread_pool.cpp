@@ -0,0 +1,129 @@
+#include <algorithm>
+
+#include "thread_pool.h"
+
+// Index of the worker running on the current thread, -1 outside of the pool
+static thread_local int current_worker = -1;
+static thread_local const ThreadPool* current_pool = nullptr;
+
+ThreadPool::ThreadPool(int thread_count) {
+	if (thread_count <= 0) {
+		thread_count = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (int i = 0; i < thread_count; i++) {
+		queues.emplace_back(new WorkQueue());
+	}
+	for (int i = 0; i < thread_count; i++) {
+		threads.emplace_back(&ThreadPool::worker_loop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock<std::mutex> guard(state_lock);
+		all_done.wait(guard, [this] { return pending == 0; });
+		stopping = true;
+	}
+	work_available.notify_all();
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+int ThreadPool::get_thread_count() const {
+	return (int)threads.size();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+	int index;
+	if (current_pool == this) {
+		index = current_worker;
+	} else {
+		index = next_queue++ % queues.size();
+	}
+
+	// Counted as pending before it can be taken, so a worker finishing it can't make wait() return early
+	{
+		std::lock_guard<std::mutex> guard(state_lock);
+		pending++;
+	}
+	{
+		std::lock_guard<std::mutex> guard(queues[index]->lock);
+		queues[index]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> guard(state_lock);
+		queued++;
+	}
+	work_available.notify_one();
+}
+
+void ThreadPool::wait() {
+	std::unique_lock<std::mutex> guard(state_lock);
+	all_done.wait(guard, [this] { return pending == 0; });
+	if (first_error) {
+		std::exception_ptr error = first_error;
+		first_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+bool ThreadPool::take_task(int index, std::function<void()>& task) {
+	// Newest task from our own queue first, it is the most likely to still be in the cache
+	{
+		WorkQueue& own = *queues[index];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+
+	// Then the oldest task of another worker
+	int count = (int)queues.size();
+	for (int offset = 1; offset < count; offset++) {
+		WorkQueue& victim = *queues[(index + offset) % count];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::worker_loop(int index) {
+	current_worker = index;
+	current_pool = this;
+
+	while (true) {
+		std::function<void()> task;
+		if (take_task(index, task)) {
+			queued--;
+			try {
+				task();
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> guard(state_lock);
+				if (!first_error) {
+					first_error = std::current_exception();
+				}
+			}
+
+			std::lock_guard<std::mutex> guard(state_lock);
+			pending--;
+			if (pending == 0) {
+				all_done.notify_all();
+			}
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(state_lock);
+		work_available.wait(guard, [this] { return queued > 0 || stopping; });
+		if (stopping && queued == 0) {
+			return;
+		}
+	}
+}
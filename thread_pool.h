@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+Fixed set of worker threads with one task queue per worker. Workers take tasks from the back of
+their own queue and, when it is empty, steal from the front of the other queues, so long tasks
+(like whole emulation sessions) spread over every core without a single contended queue.
+*/
+class ThreadPool {
+	struct WorkQueue {
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> threads;
+
+	// Sleeping workers wait for queued to become positive
+	std::mutex state_lock;
+	std::condition_variable work_available;
+	std::condition_variable all_done;
+	std::atomic<int> queued{0};
+	int pending = 0; // Submitted tasks that didn't finish yet, guarded by state_lock
+	bool stopping = false;
+	std::exception_ptr first_error;
+	std::atomic<unsigned int> next_queue{0};
+public:
+	// Start the specified number of workers, or one per core if it is 0
+	explicit ThreadPool(int thread_count = 0);
+	// Finishes the queued tasks before returning
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int get_thread_count() const;
+	// Queue a task. Tasks submitted by a worker go to its own queue.
+	void submit(std::function<void()> task);
+	// Block until every submitted task finished. Rethrows the first exception a task threw.
+	void wait();
+private:
+	void worker_loop(int index);
+	bool take_task(int index, std::function<void()>& task);
+};
@@ -4,22 +4,20 @@ by Casey Muratori, and is not commented as it is pretty much just dealing with
 Windows' APIs and its oddities.
 */
 
+#ifdef _WIN32
+
 #include <Windows.h>
+#include <algorithm>
 #include <stdexcept>
 #include <cstdint>
 
+#include "chip8.h"
 #include "windows_bindings.h"
 
 #define WINDOW_WIDTH 640
 #define WINDOW_HEIGHT 320
 
-static HDC window_device_context;
-static screen_buffer screen_buff;
-static bool key_states[16] = {};
-static bool key_capture = false;
-static int last_key = -1;
-
-void setup_drawbuffer() {
+void WindowsHost::setup_drawbuffer() {
 	screen_buff.bitmap_info.bmiHeader.biSize = sizeof(BITMAPINFO);
 	screen_buff.bitmap_info.bmiHeader.biWidth = WINDOW_WIDTH;
 	screen_buff.bitmap_info.bmiHeader.biHeight = -WINDOW_HEIGHT;
@@ -34,28 +32,16 @@ void setup_drawbuffer() {
 
 	screen_buff.width = WINDOW_WIDTH;
 	screen_buff.height = WINDOW_HEIGHT;
-
-	screen_buff.bitmap_memory = VirtualAlloc(0, 4 * WINDOW_WIDTH * WINDOW_HEIGHT, MEM_COMMIT, PAGE_READWRITE);
-	if (!screen_buff.bitmap_memory) {
-		throw std::runtime_error("Failed to allocate bitmap memory");
-	}
 }
 
-void flip_drawbuffer(HDC device_context) {
+// Presenter thread only, the front buffer belongs to it
+void WindowsHost::flip_drawbuffer(HDC device_context) {
 	StretchDIBits(device_context, 0, 0, screen_buff.width, screen_buff.height, 0, 0, screen_buff.width,
-		screen_buff.height, screen_buff.bitmap_memory, &screen_buff.bitmap_info, DIB_RGB_COLORS, SRCCOPY);
-}
-
-void draw_to_screen() {
-	flip_drawbuffer(window_device_context);
-}
-
-screen_buffer get_screen_buffer() {
-	return screen_buff;
+		screen_buff.height, frames.get_front_buffer(), &screen_buff.bitmap_info, DIB_RGB_COLORS, SRCCOPY);
 }
 
 // returns -1 if the keycode doesn't map to a chip-8 key number
-int get_chip8_key_number(int VK_code) {
+static int get_chip8_key_number(int VK_code) {
 	switch (VK_code) {
 	case 'X':
 		return 0;
@@ -94,36 +80,37 @@ int get_chip8_key_number(int VK_code) {
 	}
 }
 
-bool is_key_down(int key_number) {
-	return key_states[key_number];
-}
-
-void enable_key_capture() {
-	key_capture = true;
-}
-
-// Returns the captured key number, or -1 if not captured yet
-int get_capture_key() {
-	if (key_capture) {
-		return -1;
-	} else {
-		return last_key;
+LRESULT CALLBACK WindowsHost::WindowCallback(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wParam, _In_ LPARAM lParam) {
+	if (uMsg == WM_NCCREATE) {
+		CREATESTRUCT* create = (CREATESTRUCT*)lParam;
+		SetWindowLongPtr(hwnd, GWLP_USERDATA, (LONG_PTR)create->lpCreateParams);
+	}
+	WindowsHost* host = (WindowsHost*)GetWindowLongPtr(hwnd, GWLP_USERDATA);
+	if (!host) {
+		return DefWindowProc(hwnd, uMsg, wParam, lParam);
 	}
+	return host->handle_message(hwnd, uMsg, wParam, lParam);
 }
 
-LRESULT CALLBACK WindowCallback(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wParam, _In_ LPARAM lParam) {
+LRESULT WindowsHost::handle_message(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
 	LRESULT result = 0;
 	switch (uMsg) {
 	case WM_KEYDOWN:
 	case WM_SYSKEYDOWN: {
 		int VK_code = wParam;
+		if (VK_code == VK_BACK) {
+			rewind_held = true;
+		}
 		int key_number = get_chip8_key_number(VK_code);
 		if (key_number != -1) {
-			key_states[key_number] = true;
+			key_states.fetch_or(1 << key_number);
+			// The key is stored before the capture ends, so the emulation thread never sees the end
+			// of the capture without it
 			if (key_capture) {
 				last_key = key_number;
 				key_capture = false;
 			}
+			SetEvent(input_event);
 		}
 		//debug_print_keyboard();
 	} break;
@@ -131,9 +118,13 @@ LRESULT CALLBACK WindowCallback(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wPar
 	case WM_KEYUP:
 	case WM_SYSKEYUP: {
 		int VK_code = wParam;
+		if (VK_code == VK_BACK) {
+			rewind_held = false;
+		}
 		int key_number = get_chip8_key_number(VK_code);
 		if (key_number != -1) {
-			key_states[key_number] = false;
+			key_states.fetch_and(~(1 << key_number));
+			SetEvent(input_event);
 		}
 		//debug_print_keyboard();
 	} break;
@@ -161,13 +152,13 @@ LRESULT CALLBACK WindowCallback(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wPar
 	return result;
 }
 
-void setup_window() {
+void WindowsHost::setup_window() {
 	WNDCLASS window_class = {};
 	window_class.style = CS_OWNDC | CS_HREDRAW | CS_VREDRAW;
 	window_class.lpfnWndProc = WindowCallback;
 	window_class.hInstance = GetModuleHandle(0);
 	window_class.lpszClassName = L"CHIP8EmuWindowClass";
-	if (!RegisterClass(&window_class)) {
+	if (!RegisterClass(&window_class) && GetLastError() != ERROR_CLASS_ALREADY_EXISTS) {
 		throw std::runtime_error("Failed to register window class");
 	}
 
@@ -183,7 +174,7 @@ void setup_window() {
 	int window_height = desired_client_rect.bottom - desired_client_rect.top;
 
 	HWND window_handle = CreateWindowEx(0, window_class.lpszClassName, L"CHIP8 Emulator", window_style,
-		CW_USEDEFAULT, CW_USEDEFAULT, window_width, window_height, 0, 0, window_class.hInstance, 0);
+		CW_USEDEFAULT, CW_USEDEFAULT, window_width, window_height, 0, 0, window_class.hInstance, this);
 	if (!window_handle) {
 		throw std::runtime_error("Failed to create window");
 	}
@@ -191,12 +182,12 @@ void setup_window() {
 	window_device_context = GetDC(window_handle);
 }
 
-void debug_print_keyboard() {
+void WindowsHost::debug_print_keyboard() {
 	OutputDebugStringA("\n==========\n");
 	int keymap[] = { 1,2,3,12,4,5,6,13,7,8,9,14,10,0,11,15 };
 	for (int y = 0; y < 4; y++) {
 		for (int x = 0; x < 4; x++) {
-			if (key_states[keymap[y * 4 + x]]) {
+			if ((key_states >> keymap[y * 4 + x]) & 1) {
 				OutputDebugStringA("O ");
 			} else {
 				OutputDebugStringA("_ ");
@@ -204,4 +195,172 @@ void debug_print_keyboard() {
 		}
 		OutputDebugStringA("\n");
 	}
-}
\ No newline at end of file
+}
+
+WindowsHost::WindowsHost()
+	: scaler(WINDOW_WIDTH / SCREEN_WIDTH, WINDOW_HEIGHT / SCREEN_HEIGHT, 0x00000000, 0x00FFFFFF),
+	hires_scaler(WINDOW_WIDTH / HIRES_SCREEN_WIDTH, WINDOW_HEIGHT / HIRES_SCREEN_HEIGHT, 0x00000000, 0x00FFFFFF),
+	frames(WINDOW_WIDTH, WINDOW_HEIGHT) {
+	// Auto-reset, every wait consumes the signal that woke it
+	frame_event = CreateEvent(0, FALSE, FALSE, 0);
+	input_event = CreateEvent(0, FALSE, FALSE, 0);
+	if (!frame_event || !input_event) {
+		throw std::runtime_error("Failed to create events");
+	}
+	setup_window();
+
+	// We sleep to yield time to the cpu, so we set the clock precision so
+	// we can be sure we don't over-sleep.
+	timeBeginPeriod(1);
+}
+
+WindowsHost::~WindowsHost() {
+	if (wave_out) {
+		waveOutReset(wave_out);
+		for (int i = 0; i < AUDIO_BUFFER_COUNT; i++) {
+			waveOutUnprepareHeader(wave_out, &wave_headers[i], sizeof(WAVEHDR));
+		}
+		waveOutClose(wave_out);
+	}
+	timeEndPeriod(1);
+	CloseHandle(frame_event);
+	CloseHandle(input_event);
+}
+
+bool WindowsHost::is_key_down(int key_number) {
+	return (key_states.load(std::memory_order_relaxed) >> key_number) & 1;
+}
+
+void WindowsHost::enable_key_capture() {
+	key_capture = true;
+}
+
+// Returns the captured key number, or -1 if not captured yet
+int WindowsHost::get_capture_key() {
+	if (key_capture) {
+		return -1;
+	} else {
+		return last_key;
+	}
+}
+
+void WindowsHost::start_audio(AudioRing& ring, Beeper& beeper) {
+	WAVEFORMATEX format = {};
+	format.wFormatTag = WAVE_FORMAT_PCM;
+	format.nChannels = 1;
+	format.nSamplesPerSec = AUDIO_SAMPLE_RATE;
+	format.wBitsPerSample = 16;
+	format.nBlockAlign = 2;
+	format.nAvgBytesPerSec = AUDIO_SAMPLE_RATE * 2;
+	if (waveOutOpen(&wave_out, WAVE_MAPPER, &format, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR) {
+		wave_out = 0;
+		return;
+	}
+
+	audio_ring = &ring;
+	this->beeper = &beeper;
+	for (int i = 0; i < AUDIO_BUFFER_COUNT; i++) {
+		wave_headers[i].lpData = (LPSTR)wave_buffers[i];
+		wave_headers[i].dwBufferLength = sizeof(wave_buffers[i]);
+		waveOutPrepareHeader(wave_out, &wave_headers[i], sizeof(WAVEHDR));
+		// Start with silence, so there is always a buffer playing while the next ones are filled
+		waveOutWrite(wave_out, &wave_headers[i], sizeof(WAVEHDR));
+	}
+}
+
+// Polled every frame instead of using the waveOut callback, which isn't allowed to call waveOutWrite
+void WindowsHost::fill_audio_buffers() {
+	for (int i = 0; i < AUDIO_BUFFER_COUNT; i++) {
+		if (!(wave_headers[i].dwFlags & WHDR_DONE)) {
+			continue;
+		}
+		// If the emulation fell behind, the rest of the buffer is silence
+		size_t count = audio_ring->pop(wave_buffers[i], AUDIO_BUFFER_SAMPLES);
+		std::fill(wave_buffers[i] + count, wave_buffers[i] + AUDIO_BUFFER_SAMPLES, 0);
+		waveOutWrite(wave_out, &wave_headers[i], sizeof(WAVEHDR));
+	}
+}
+
+void WindowsHost::run_presenter() {
+	while (!presenter_stopping) {
+		MSG message;
+		while (PeekMessage(&message, 0, 0, 0, PM_REMOVE)) {
+			if (message.message == WM_QUIT) {
+				quit_requested = true;
+				// Wakes the emulation thread if it is waiting for a key
+				SetEvent(input_event);
+			}
+
+			TranslateMessage(&message);
+			DispatchMessage(&message);
+		}
+		if (quit_requested) {
+			return;
+		}
+
+		if (wave_out) {
+			fill_audio_buffers();
+		}
+		if (frames.acquire()) {
+			flip_drawbuffer(window_device_context);
+		}
+
+		// Sleeps until there is a message or a new frame. The timeout keeps the sound buffers filled
+		// while nothing is drawn.
+		MsgWaitForMultipleObjects(1, &frame_event, FALSE, 1000 / 60, QS_ALLINPUT);
+	}
+}
+
+void WindowsHost::stop_presenting() {
+	presenter_stopping = true;
+	SetEvent(frame_event);
+}
+
+bool WindowsHost::process_events() {
+	return !quit_requested;
+}
+
+void WindowsHost::present(const Chip8& emu) {
+	// Only rows that are out of date in the back buffer are scaled again
+	uint64_t rows = frames.mark_changed_rows(emu.get_dirty_rows());
+	int width = emu.get_screen_width();
+	int height = emu.get_screen_height();
+	const Scaler& screen_scaler = (width == HIRES_SCREEN_WIDTH) ? hires_scaler : scaler;
+	if (emu.get_variant() == VARIANT_XOCHIP) {
+		screen_scaler.scale_planes(emu.get_screen_rows(0), emu.get_screen_rows(1), width, height, rows,
+			frames.get_back_buffer(), frames.get_width());
+	} else {
+		screen_scaler.scale(emu.get_screen_rows(), width, height, rows, frames.get_back_buffer(), frames.get_width());
+	}
+	frames.publish();
+	SetEvent(frame_event);
+}
+
+void WindowsHost::wait_until(std::chrono::steady_clock::time_point deadline) {
+	// We sleep to yield time to the cpu, the clock precision was set to 1ms so we don't over-sleep.
+	auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+	if (remaining.count() > 0) {
+		Sleep((DWORD)remaining.count());
+	}
+}
+
+void WindowsHost::wait_for_input(std::chrono::steady_clock::time_point deadline) {
+	// Wakes up as soon as the presenter sees a key change or the window closing
+	auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+	if (remaining.count() > 0) {
+		WaitForSingleObject(input_event, (DWORD)remaining.count());
+	}
+}
+
+// Backspace plays the session backwards while held
+bool WindowsHost::is_rewinding() {
+	return rewind_held;
+}
+
+void WindowsHost::sound_changed(const Chip8& emu) {
+	if (beeper) {
+		beeper->sound_changed(emu);
+	}
+}
+
+#endif
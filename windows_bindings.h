@@ -1,22 +1,89 @@
 #pragma once
 #include <windows.h>
+#include <atomic>
+
+#include "audio.h"
+#include "chip8_host.h"
+#include "frame_handoff.h"
+#include "scaler.h"
+
+// waveOut buffers of one 60Hz frame each, refilled from the audio ring as they finish playing
+#define AUDIO_BUFFER_COUNT 4
+#define AUDIO_BUFFER_SAMPLES (AUDIO_SAMPLE_RATE / 60)
 
 struct screen_buffer {
 	BITMAPINFO bitmap_info;
-	void* bitmap_memory;
 	int width;
 	int height;
 };
 
-void setup_window();
+/*
+Runs the interpreter inside a window. All the window and keyboard state belongs to the instance.
+
+The window and its messages belong to the thread that created the host, which runs run_presenter,
+while the interpreter runs on another thread and calls the Chip8Host methods. present scales the
+screen into the back buffer of a FrameHandoff on the emulation thread, and the presenter blits the
+newest frame whenever one arrives, so a slow blit never holds up emulation. Input goes the other
+way through atomics: a word with a bit per key, and the key capture of LD Vx, K.
+*/
+class WindowsHost : public Chip8Host {
+	// The window stays the same size, so the high resolution screen is scaled by half as much
+	Scaler scaler;
+	Scaler hires_scaler;
+	HDC window_device_context = 0;
+	screen_buffer screen_buff = {};
+	FrameHandoff frames;
+	// Signaled when a frame is published or the presenter should stop, and on input
+	HANDLE frame_event = 0;
+	HANDLE input_event = 0;
+	std::atomic<bool> quit_requested{false};
+	std::atomic<bool> presenter_stopping{false};
+
+	// Bit k is set while key k is held down
+	std::atomic<uint16_t> key_states{0};
+	std::atomic<bool> key_capture{false};
+	std::atomic<int> last_key{-1};
+	std::atomic<bool> rewind_held{false};
 
-bool is_key_down(int key_number);
+	AudioRing* audio_ring = nullptr;
+	Beeper* beeper = nullptr;
+	HWAVEOUT wave_out = 0;
+	WAVEHDR wave_headers[AUDIO_BUFFER_COUNT] = {};
+	int16_t wave_buffers[AUDIO_BUFFER_COUNT][AUDIO_BUFFER_SAMPLES] = {};
 
-void enable_key_capture();
+	void setup_drawbuffer();
+	void setup_window();
+	void flip_drawbuffer(HDC device_context);
+	void debug_print_keyboard();
+	void fill_audio_buffers();
 
-// Returns the captured key number, or -1 if not captured yet
-int get_capture_key();
+	static LRESULT CALLBACK WindowCallback(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+	LRESULT handle_message(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+public:
+	WindowsHost();
+	~WindowsHost();
+	WindowsHost(const WindowsHost&) = delete;
+	WindowsHost& operator=(const WindowsHost&) = delete;
 
-void draw_to_screen();
+	// Play the sound that beeper puts in the ring. Without a sound device nothing is played.
+	void start_audio(AudioRing& ring, Beeper& beeper);
 
-screen_buffer get_screen_buffer();
\ No newline at end of file
+	// Presenter side: pump window messages, play sound and show published frames until the window is
+	// closed or stop_presenting is called
+	void run_presenter();
+	// Called from the emulation thread once it is done, makes run_presenter return
+	void stop_presenting();
+
+	// The rest is called from the emulation thread. process_events returns false once the window
+	// was closed.
+	bool is_key_down(int key_number) override;
+	void enable_key_capture() override;
+	int get_capture_key() override;
+
+	bool process_events() override;
+	void present(const Chip8& emu) override;
+	void wait_until(std::chrono::steady_clock::time_point deadline) override;
+	void wait_for_input(std::chrono::steady_clock::time_point deadline) override;
+	bool is_rewinding() override;
+	void sound_changed(const Chip8& emu) override;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+xoshiro128** (https://prng.di.unimi.it) by David Blackman and Sebastiano Vigna: 16 bytes of state
+and a handful of instructions per number. The state is plain data, so it is copied along with the
+interpreter that owns it and the same seed always gives the same sequence.
+*/
+struct Xoshiro128 {
+	uint32_t state[4];
+
+	// Expand a 64-bit seed with splitmix64, so every seed (including 0) gives a usable state
+	void seed(uint64_t seed) {
+		for (int i = 0; i < 4; i += 2) {
+			seed += 0x9E3779B97F4A7C15ull;
+			uint64_t z = seed;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			z ^= z >> 31;
+			state[i] = (uint32_t)z;
+			state[i + 1] = (uint32_t)(z >> 32);
+		}
+	}
+
+	uint32_t next() {
+		uint32_t result = rotate_left(state[1] * 5, 7) * 9;
+		uint32_t t = state[1] << 9;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= t;
+		state[3] = rotate_left(state[3], 11);
+		return result;
+	}
+
+	static uint32_t rotate_left(uint32_t value, int amount) {
+		return (value << amount) | (value >> (32 - amount));
+	}
+};